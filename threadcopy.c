@@ -16,16 +16,42 @@
  Compile with: gcc -O2 -Wpedantic -pthread threadcopy.c -o threadcopy
 */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
 /* Command exit codes. */
 #define EXIT_OK 0
 #define READ_ERROR 1
@@ -40,88 +66,897 @@
 #define TS_CHECKED 3
 
 /* File related. */
-#define BLOCKSIZE 4096
-#define PATH_MAX 1024
-#define FILES_MAX 10000
+#define BLOCKSIZE 4096 /* default I/O block size */
+#define BLOCKSIZE_MAX (1UL << 30)
+#define DIRECT_ALIGN 4096 /* O_DIRECT offset, length and buffer alignment */
+#define ARENA_BLOCK 65536 /* path arena allocation unit */
+#define TABLE_SEGMENT 1024 /* file table entries per segment */
+
+/* Copy engines. */
+#define ENGINE_AUTO 0
+#define ENGINE_STDIO 1
+#define ENGINE_CFR 2
+#define ENGINE_SENDFILE 3
+#define ENGINE_REFLINK 4
+#define ENGINE_URING 5
+#define ENGINE_DELTA 6
+#define ENGINE_MMAP 7
+#define MMAP_WINDOW (64UL << 20) /* input mapped at a time */
+#define ENGINE_UNSUPPORTED -1 /* engine can't handle this file pair */
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define KCOPY_MAX 0x40000000 /* bytes per kernel copy call */
+
+/* Large file chunking. */
+#define CHUNKSIZE (1UL << 30) /* default chunk size and split threshold */
+#define COPY_TO_EOF (~0UL) /* task length of a whole file copy */
+
+/* Same layout as the kernel's struct file_clone_range. */
+typedef struct Clonerange
+{
+  int64_t src_fd;
+  uint64_t src_offset;
+  uint64_t src_length;
+  uint64_t dest_offset;
+} clonerange;
+#define FICLONERANGE_TC _IOW(0x94, 13, clonerange)
 
-#define UWAIT 1000
+#define COMPARE_STRIDE 4096 /* memcmp stride before locating a mismatch */
+
+/* Verify modes. */
+#define VERIFY_NONE 0
+#define VERIFY_BYTES 1 /* reread both files */
+#define VERIFY_SINGLE 2 /* digest input during copy, reread output only */
+
+/* Verify hash algorithms, digests are stored in canonical byte order. */
+#define HASH_XXH64 0
+#define HASH_CRC32C 1
+#define HASH_BLAKE3 2
+#define HASH_MAX 32 /* largest digest in bytes */
+
+#define CRC32C_POLY 0x82F63B78 /* reflected Castagnoli polynomial */
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_PARENT 4
+#define BLAKE3_ROOT 8
+
+/* XXH64 primes. */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+/* Long options. */
+#define OPT_ENGINE 256
+#define OPT_DIRECT 257
+#define OPT_PIPELINE 258
+#define OPT_VERIFY 259
+#define OPT_MANIFEST 260
+#define OPT_CHUNK 261
+#define OPT_NO_PREALLOC 262
+#define OPT_FROM_FILE 263
+#define OPT_FROM0 264
+#define OPT_SCHEDULE 265
+#define OPT_BWLIMIT 266
+#define OPT_IOPS_LIMIT 267
+#define OPT_CONTROL 268
+#define OPT_PROGRESS 269
+#define OPT_STATS 270
+#define OPT_BENCH 271
+#define OPT_UPDATE 272
+#define OPT_RESUME 273
+#define OPT_DELTA 274
+#define OPT_SPARSE 275
+#define OPT_DEV_JOBS 276
+#define OPT_CPUS 277
+#define OPT_NUMA 278
+#define OPT_SYNC 279
+#define OPT_LISTEN 280
+#define OPT_ROOT 281
+#define OPT_RETRY 282
+#define OPT_BIND 283
+#define OPT_ALSO_TO 284
+
+/* Worker pool. */
+#define JOBS_MAX 1024
+#define PIPELINE_MAX 64 /* max ring buffers per pipelined copy */
+#define URING_DEPTH 8 /* default io_uring blocks in flight per copy */
+#define RING_MEMORY (1UL << 30) /* ring buffers of all workers together */
+#define NODES_MAX 64 /* NUMA nodes looked for in sysfs */
 
 #define DELIMITER "|"
+#define DENTS_SIZE 32768 /* getdents64 buffer per directory walk */
+
+/* Scheduling policies. */
+#define SCHEDULE_FIFO 0
+#define SCHEDULE_LARGEST 1
+#define SCHEDULE_INTERLEAVE 2
+#define BATCH_SMALL 65536 /* files below this size are batched */
+#define BATCH_FILES 64 /* max files per batch */
+#define BATCH_BYTES (1UL << 20) /* max bytes per batch */
+#define HOLD_FDS_MAX 1024 /* max probed inputs kept open */
+#define DEV_ROTATIONAL_JOBS 2 /* tasks at a time on a rotational disk */
+
+/* Durability policies. */
+#define SYNC_NONE 0 /* left to the kernel */
+#define SYNC_FILE 1 /* fdatasync each output */
+#define SYNC_BATCH 2 /* syncfs for a group of finished outputs */
+#define SYNC_END 3 /* syncfs each output filesystem at exit */
+#define WRITEBACK_BYTES (8UL << 20) /* written before write-back is started */
+#define SYNC_BATCH_FILES 256 /* max files per sync group */
+#define SYNC_BATCH_BYTES (1UL << 30) /* max bytes per sync group */
+#define SYNC_BATCH_NS 1000000000ULL /* max age of a sync group */
+
+/* Where a file pair failed, for the failure list and --stats. */
+#define PHASE_NONE 0
+#define PHASE_OPEN 1
+#define PHASE_READ 2
+#define PHASE_WRITE 3
+#define PHASE_SYNC 4 /* fdatasync, syncfs or close */
+#define PHASE_VERIFY 5
+#define PHASE_SEND 6 /* streaming to a --listen receiver */
+#define PHASE_WALK 7 /* reading or creating a directory */
+
+/* Retries of failed tasks. */
+#define RETRY_MAX 100
+#define RETRY_BACKOFF_NS 1000000000ULL /* before the first retry, doubles */
+#define RETRY_BACKOFF_MAX_NS 60000000000ULL
+
+/* Throttling. */
+#define THROTTLE_BURST 100000000ULL /* ns of tokens a bucket can save up */
+#define CONTROL_POLL 1 /* seconds between control file checks */
+
+/* Progress reporting. */
+#define PROGRESS_INTERVAL 1 /* default seconds between reports */
+#define PROGRESS_SLOW 3 /* slowest in-flight files listed per report */
+
+/* Statistics output. */
+#define STATS_NONE 0
+#define STATS_JSON 1
+#define STATS_CSV 2
+#define LAT_READ 0 /* per block latency histograms */
+#define LAT_WRITE 1
+#define LAT_COPY 2 /* in-kernel copy calls */
+#define LAT_KINDS 3
+#define HIST_SUB 8 /* linear buckets per power of two */
+#define HIST_BUCKETS (62 * HIST_SUB) /* covers every 64 bit ns value */
+
+/* Network streaming. */
+#define NET_PORT 7070 /* default port of host:path outputs */
+#define NET_HOST_MAX 256
+#define NET_LINE 128 /* request and reply line size */
+#define NET_BIND "127.0.0.1" /* default --listen address */
+#define NET_CONNS_MAX 64 /* senders served at a time */
+#define NET_TIMEOUT 60 /* seconds a receiver waits on an idle sender */
+
+/* Benchmark. */
+#define BENCH_SEED 0x9E3779B97F4A7C15ULL /* workload contents */
+#define BENCH_BUFFER (1UL << 20) /* generator write size */
+#define BENCH_EXTENT (1UL << 20) /* data per sparse file stride */
+#define BENCH_HOLE (8UL << 20) /* sparse file stride */
 
 /* Structures. */
+struct Workerdata;
+
+/* Streaming XXH64 state. */
+typedef struct Xxh64state
+{
+  uint64_t v[4];
+  uint64_t total_len;
+  unsigned char mem[32];
+  unsigned int memsize;
+} xxh64state;
+
+/* Streaming BLAKE3 state, plain portable implementation. */
+typedef struct Blake3state
+{
+  uint32_t key[8];
+  uint32_t cv[8]; /* chaining value of the current chunk */
+  uint64_t chunk_counter;
+  unsigned char block[BLAKE3_BLOCK_LEN];
+  unsigned int block_len;
+  unsigned int blocks_compressed;
+  uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+  unsigned int cv_stack_len;
+} blake3state;
+
+/* Hash state for any of the HASH_* algorithms. */
+typedef struct Hashstate
+{
+  int alg;
+  union
+  {
+    xxh64state xxh64;
+    uint32_t crc32c;
+    blake3state blake3;
+  } u;
+} hashstate;
+
 typedef struct Filedata
 {
-  char input_name[PATH_MAX];
-  char output_name[PATH_MAX];
+  char *input_name; /* in the file table path arena */
+  char *output_name;
   unsigned long int size;
-  double time_usec;
-  double time_sec;
+  double time; /* seconds from first task picked up to last one done */
+  int index;
+  int engine; /* engine used for the copy */
   int result;
   int status;
-  int verify;
+  int verify; /* VERIFY_* mode */
+  int dir; /* directory to walk instead of a file pair */
+  mode_t mode; /* of a created directory, set once the tree is copied */
+  int probe; /* size not known yet, a worker probes the input first */
+  int infd; /* input opened by the probe, -1 when not held */
+  int skip; /* output unchanged or all chunks journaled, nothing to copy */
+  int remote; /* output is host:path on a --listen receiver */
+  int created; /* made by this run, --sync=file syncs its directory */
+  struct Filedata *replica; /* next output of a fan-out copy */
+  int replicas; /* outputs after this one, written in the same pass */
+  int queue; /* devqueue of the tasks */
+  dev_t in_dev; /* devices of input and output, from the probe */
+  dev_t out_dev;
+  struct timespec mtime; /* input, given to the output by --update */
+  int chunks; /* tasks not yet done */
+  struct Copytask *tasks; /* whole file or chunks, freed once collected */
+  unsigned char digest[HASH_MAX]; /* input digest for single-pass verify */
+  uint64_t start; /* first task picked up, CLOCK_MONOTONIC ns */
+  uint64_t open_ns; /* summed over tasks, for --stats */
+  uint64_t copy_ns;
+  uint64_t verify_ns;
+  int phase; /* PHASE_* of the first failure */
+  int err; /* errno of the first failure, 0 when it had none */
+  unsigned long int err_offset; /* input offset the failure was at */
+  int retries; /* most times one of its tasks was retried */
 } filedata;
 
+/* Paths are packed into arena blocks and entries into fixed size
+   segments, neither moves once handed out so pointers stay valid while
+   the table grows. */
+typedef struct Arenablock
+{
+  struct Arenablock *next;
+  size_t used;
+  size_t size;
+  char data[];
+} arenablock;
+
+typedef struct Filetable
+{
+  filedata **segments;
+  int nsegments;
+  int count;
+  arenablock *arena;
+  pthread_mutex_t lock; /* feeder and directory walks add concurrently */
+} filetable;
+
+/* Chunk finished by an earlier run, loaded from the --resume journal. */
+typedef struct Journalentry
+{
+  char *output;
+  unsigned long int offset;
+  unsigned long int length;
+  unsigned long int size; /* input size and mtime when it was copied */
+  struct timespec mtime;
+} journalentry;
+
+/* Synthetic benchmark workload, sizes between min and max. */
+typedef struct Benchload
+{
+  const char *name;
+  int files;
+  unsigned long int min;
+  unsigned long int max;
+  int sparse; /* holes between BENCH_EXTENT sized extents */
+} benchload;
+
+/* Unit of work for the pool, a whole file pair or a byte range of one
+   that goes into an already sized destination. */
+typedef struct Copytask
+{
+  filedata *fdata;
+  struct Workerdata *worker; /* worker copying this task */
+  unsigned long int offset;
+  unsigned long int length; /* COPY_TO_EOF for a whole file */
+  int engine;
+  int result;
+  unsigned char digest[HASH_MAX]; /* input digest of the range */
+  uint64_t open_ns; /* phase times for --stats */
+  uint64_t copy_ns;
+  uint64_t verify_ns;
+  unsigned long int key; /* scheduling priority, larger runs first */
+  unsigned long int seq; /* queue order among equal keys */
+  struct Copytask *next; /* rest of a small file batch */
+  int outfd; /* output while copying, for write-back */
+  int *outfds; /* outputs of the fdata replicas, -1 once failed */
+  unsigned long int unflushed; /* written since write-back was started */
+  int phase; /* failure of the last attempt, as in filedata */
+  int err;
+  unsigned long int err_offset;
+  int retries; /* attempts after the first */
+  uint64_t due; /* a waiting retry goes back on its queue at this time */
+} copytask;
+
+/* Copy engine, returns a command exit code or ENGINE_UNSUPPORTED when
+   nothing was copied and the next engine should be tried. */
+typedef struct Copyengine
+{
+  const char *name;
+  int (*copy)(copytask *task, int infd, int outfd);
+} copyengine;
+
+/* Shared work queue of tasks handed out to the worker pool. */
+/* Binary max heap of tasks on (key, -seq), equal keys come out FIFO. */
+typedef struct Taskheap
+{
+  copytask **items;
+  int count;
+  int size;
+} taskheap;
+
+/* Tasks between one input and one output device. */
+typedef struct Devqueue
+{
+  int in; /* devices index, -1 for probes and directory walks */
+  int out;
+  taskheap lanes[2]; /* interleave keeps small tasks in the second lane */
+  int turn; /* lane to take from next when interleaving */
+  int node; /* NUMA node of the devices, -1 when unknown */
+  copytask *batch; /* small file batch being filled */
+  copytask *batch_tail;
+  int batch_files;
+  unsigned long int batch_bytes;
+} devqueue;
+
+/* Device files are read from or written to, by st_dev. */
+typedef struct Device
+{
+  dev_t dev;
+  int limit; /* tasks at a time, 0 is unlimited */
+  int active; /* tasks running, a batch counts once */
+  int node; /* NUMA node the device hangs off, -1 when unknown */
+} device;
+
+typedef struct Workqueue
+{
+  devqueue *queues; /* queue 0 is for probes and directory walks */
+  int nqueues;
+  device *devices;
+  int ndevices;
+  int queued; /* tasks queued so far */
+  unsigned long int seq;
+  int producers; /* main, the list feeder and directories being walked */
+  int closed; /* no more tasks will be queued */
+  copytask *retry; /* failed tasks waiting out their backoff, by due time */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} workqueue;
+
+/* Completion queue, workers push finished file pairs for main to collect. */
+typedef struct Donequeue
+{
+  filedata **items;
+  int head;
+  int tail;
+  int size;
+  int expected; /* file pairs queued so far */
+  int closed; /* expected is final */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} donequeue;
+
+/* Finished file pairs waiting for a sync of their filesystems before
+   they are handed to main. */
+typedef struct Syncgroup
+{
+  filedata **items;
+  int count;
+  int size;
+  unsigned long int bytes;
+  uint64_t start; /* first file added, CLOCK_MONOTONIC ns */
+  pthread_mutex_t lock;
+} syncgroup;
+
+/* Directory entry as returned by getdents64. */
+typedef struct Dirent64
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+} dirent64;
+
+/* Token bucket shared by all workers without a lock, next is the time at
+   which the bucket runs dry and moves on with every take. */
+typedef struct Throttle
+{
+  unsigned long int rate; /* units per second, 0 is unlimited */
+  uint64_t next; /* CLOCK_MONOTONIC ns */
+} throttle;
+
+/* Reads file pairs from a list while the pool is already copying. */
+typedef struct Feeder
+{
+  FILE *list;
+  const char *name;
+  int delim; /* '\n' for tab separated lines, '\0' for NUL separated */
+  int verify;
+  int queued;
+  int skipped;
+  int result;
+} feeder;
+
+/* Per worker state, I/O buffers are allocated once per worker. */
+typedef struct Workerdata
+{
+  int id;
+  int node; /* NUMA node the worker is placed on, -1 when not placed */
+  int pinned; /* runs on cpus only */
+  cpu_set_t cpus;
+  unsigned char *ibuffer;
+  unsigned char *obuffer;
+  unsigned char *ring; /* pipeline ring, ring_depth * blocksize bytes */
+  struct Uring *uring; /* io_uring instance, set up on first use */
+  struct Pipering *pipe; /* pipeline ring and writer, set up on first use */
+  int sock; /* connection to a receiver, -1 when none */
+  char peer[NET_HOST_MAX + 8]; /* host:port of sock */
+  hashstate vhash; /* input digest of the current single-pass verify */
+  /* Progress, written by the worker and read by the reporter with relaxed
+     atomics only. */
+  unsigned long int bytes; /* copied in total */
+  filedata *current; /* file of the task being copied, NULL when idle */
+  unsigned long int task_bytes; /* copied of the current task */
+  unsigned long int task_length; /* bytes in the current task, 0 unknown */
+  uint64_t task_start; /* CLOCK_MONOTONIC ns */
+  uint64_t *lat; /* LAT_KINDS histograms of HIST_BUCKETS, NULL unless --stats */
+} workerdata;
+
+#ifdef HAVE_IO_URING
+/* Raw io_uring instance, one per worker with the ring buffers registered
+   as fixed buffers and two fixed file slots for the current file pair. */
+typedef struct Uring
+{
+  int fd;
+  unsigned int entries;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_len;
+  size_t cq_len;
+  size_t sqes_len;
+  int fixed_files;
+  int broken; /* requests could not be reaped, the ring is not reused */
+} uring;
+
+/* State of one ring buffer slot, a read linked to a write. */
+typedef struct Uringslot
+{
+  unsigned long int offset;
+  size_t length;
+  int read_res;
+  int write_res;
+  int pending; /* completions still expected */
+  size_t copied; /* bytes that made it to the output */
+  int hashed; /* waiting to be digested in offset order */
+  uint64_t submitted; /* CLOCK_MONOTONIC ns, for --stats */
+} uringslot;
+#endif
+
+/* Ring of buffers between the reader and writer stage of a pipelined
+   copy, slots are filled at head and drained at tail. Each worker has one
+   with a writer thread that serves it for every file. */
+typedef struct Pipering
+{
+  copytask *task;
+  int outfd;
+  unsigned char *buffers;
+  size_t lengths[PIPELINE_MAX];
+  int depth;
+  int head;
+  int tail;
+  int count;
+  int eof; /* reader done with the file, cleared by the writer once drained */
+  int result; /* writer result, reader stops on error */
+  int err; /* errno of the writer error */
+  int quit; /* worker is done, the writer thread ends */
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} pipering;
+
 /* Prototypes. */
 void *copyFile(void *arg);
-unsigned int get_filenames(char *farg, char fn[FILES_MAX][PATH_MAX]);
-unsigned long int check_file_size(FILE *fp);
+void *workerThread(void *arg);
+void *feedFiles(void *arg);
+int add_file(const char *input, const char *output, int index, int verify,
+             int async, const filedata *parent, char *const *extra);
+void add_replicas(filedata *fdata, char *const *extra,
+                  const filedata *parent);
+int probe_file(filedata *fdata);
+void probe_failed(filedata *fdata, int err, int retries);
+void queue_probe(filedata *fdata);
+int add_dir(const char *input, const char *output, int verify,
+            const filedata *parent, char *const *extra);
+void walkDir(copytask *task);
+void queue_file(filedata *fdata);
+void queue_push(workqueue *wq, copytask *task);
+void queue_retry(workqueue *wq, copytask *task);
+copytask *queue_pop(workqueue *wq, int node);
+int queue_ready(const workqueue *wq, const devqueue *q);
+void queue_take(workqueue *wq, const devqueue *q, int count);
+void queue_release(workqueue *wq, int queue);
+int queue_index(workqueue *wq, const filedata *fdata);
+int queue_add(workqueue *wq, int in, int out);
+int device_index(workqueue *wq, dev_t dev);
+int device_rotational(dev_t dev);
+int device_node(dev_t dev);
+dev_t output_dev(const char *name);
+void queue_close(workqueue *wq, donequeue *dq);
+int task_before(const copytask *a, const copytask *b);
+void heap_push(taskheap *h, copytask *task);
+copytask *heap_pop(taskheap *h);
+int verify_bytes(copytask *task);
+int verify_mapped(copytask *task);
+int verify_readback(copytask *task);
+int copy_engine(copytask *task, int infd, int outfd);
+int copy_sparse(copytask *task, int infd, int outfd);
+int sparse_hole(copytask *task, int outfd, unsigned long int offset,
+                unsigned long int len);
+unsigned long int data_extent(int fd, unsigned long int *pos,
+                              unsigned long int end);
+void hash_zeros(hashstate *state, unsigned char *buf, unsigned long int len);
+int engine_stdio(copytask *task, int infd, int outfd);
+int copy_buffered(copytask *task, int infd, int outfd);
+int copy_fanout(copytask *task, int infd, int outfd);
+int copy_pipelined(copytask *task, int infd, int outfd);
+pipering *pipe_start(workerdata *wdata);
+void pipe_stop(pipering *ring);
+void *pipeWriter(void *arg);
+int engine_cfr(copytask *task, int infd, int outfd);
+int engine_sendfile(copytask *task, int infd, int outfd);
+int engine_reflink(copytask *task, int infd, int outfd);
+int engine_uring(copytask *task, int infd, int outfd);
+int engine_delta(copytask *task, int infd, int outfd);
+int engine_mmap(copytask *task, int infd, int outfd);
+void mmap_fault(int sig);
+#ifdef HAVE_IO_URING
+uring *uring_setup(workerdata *wdata);
+void uring_free(uring *ring);
+int uring_drain(uring *ring, int inflight);
+int uring_copy(copytask *task, uring *ring, int infd, int outfd,
+               unsigned long int end);
+int uring_files(uring *ring, int infd, int outfd);
+void uring_push(uring *ring, int op, int fd, unsigned char *buf, size_t len,
+                unsigned long int offset, int flags, int index,
+                unsigned long int data);
+int uring_finish(uringslot *slot, unsigned char *buf, int outfd, int *stop);
+#endif
+int preallocate(copytask *task, int outfd);
+void replicas_open(copytask *task, int whole);
+void replicas_close(copytask *task, int result);
+void replicas_verify(copytask *task);
+void replica_result(filedata *fdata, const copytask *task, int result,
+                    int phase);
+void fanout_write(copytask *task, const unsigned char *buf, size_t len);
+int kcopy_unsupported(int err, int infd, unsigned long int end);
+int kcopy_error(int err);
+int open_direct(const char *name, int flags);
+int drop_direct(int fd);
+ssize_t read_full(int fd, unsigned char *buf, size_t len, uint64_t *hist);
+int write_all(int fd, const unsigned char *buf, size_t len, uint64_t *hist);
+int parse_size(const char *arg, unsigned long int *size);
+int parse_rate(const char *arg, unsigned long int *rate);
+int parse_cpus(const char *arg, cpu_set_t *set);
+int numa_setup(const cpu_set_t *allowed);
+void place_worker(workerdata *wdata);
+void throttle_io(unsigned long int bytes, unsigned long int ops);
+void throttle_take(throttle *bucket, unsigned long int units);
+uint64_t monotonic_ns(void);
+double elapsed(uint64_t start, uint64_t end);
+void progress_add(copytask *task, unsigned long int bytes);
+uint64_t *latency_hist(copytask *task, int kind);
+void latency_add(uint64_t *hist, uint64_t start);
+int hist_bucket(uint64_t ns);
+uint64_t hist_upper(int bucket);
+uint64_t hist_percentile(const uint64_t *hist, uint64_t count, double pct);
+int write_stats(FILE *out, const uint64_t *lat, double total);
+void stats_string(FILE *out, const char *str);
+int run_bench(const char *dir);
+int bench_workload(const char *dir, const benchload *load,
+                   unsigned long int *bytes);
+uint64_t bench_random(uint64_t *state);
+int bench_run(char **args, struct rusage *ru, double *wall);
+void bench_drop(const char *dir);
+void bench_clear(const char *dir);
+void *progressThread(void *arg);
+int load_control(const char *name);
+void *controlThread(void *arg);
+size_t compare_block(const unsigned char *a, const unsigned char *b,
+                     size_t len);
+void hash_init(hashstate *state, int alg);
+void hash_update(hashstate *state, const unsigned char *buf, size_t len);
+void hash_final(const hashstate *state, unsigned char *digest);
+void hash_hex(const unsigned char *digest, int alg, char *hex);
+void xxh64_init(xxh64state *state);
+void xxh64_update(xxh64state *state, const unsigned char *buf, size_t len);
+uint64_t xxh64_digest(const xxh64state *state);
+uint32_t crc32c_update(uint32_t crc, const unsigned char *buf, size_t len);
+void blake3_init(blake3state *state);
+void blake3_update(blake3state *state, const unsigned char *buf, size_t len);
+void blake3_final(const blake3state *state, unsigned char *digest);
+int prepare_chunks(filedata *fdata, int keep);
+int load_journal(const char *name);
+int journal_cmp(const void *a, const void *b);
+int journal_done(const filedata *fdata, unsigned long int offset,
+                 unsigned long int length);
+void journal_add(copytask *task);
+void done_task(donequeue *dq, copytask *task);
+void done_push(donequeue *dq, filedata *fdata);
+void sync_add(syncgroup *sg, filedata *fdata);
+void sync_flush(syncgroup *sg, int force);
+int sync_outputs(filedata **items, int count);
+void sync_written(copytask *task, unsigned long int bytes);
+int sync_parent(const char *path);
+int sync_held(const filedata *fdata);
+const char *remote_path(const char *name, char *host, size_t hostlen,
+                        int *port);
+int copy_remote(copytask *task, int infd);
+int net_send(copytask *task, int infd, unsigned long int offset,
+             unsigned long int len, int alg);
+int net_connect(workerdata *wdata, const char *host, int port);
+ssize_t net_line(int fd, char *line, size_t size);
+int run_listen(int port);
+void *netReceiver(void *arg);
+int net_receive(FILE *in, int sock, unsigned char *buf, const char *header);
+int net_digest(int fd, unsigned long int offset, unsigned long int len,
+               int alg, unsigned char *buf, char *hex);
+char *net_output(const char *path);
+int net_open(const char *path, int flags);
+filedata *done_pop(donequeue *dq);
+void task_failed(copytask *task, int phase);
+unsigned long int fail_offset(const copytask *task, int phase);
+int worst_result(int a, int b);
+int report_failures(void);
+int file_complete(filedata *fdata, FILE *manifest);
+int dir_modes(void);
+filedata *table_add(filetable *t, const char *input, const char *output);
+filedata *table_get(const filetable *t, int i);
+char *table_path(filetable *t, const char *path);
+void table_free(filetable *t);
+unsigned int get_filenames(char *farg, char ***fn);
 
 /* Macros and globals. */
 int pout = 1; /* quiet flag */
 #define PRINT(...) if(pout){printf(__VA_ARGS__);}
 int dout = 0; /* debug flag */
 #define DPRINT(...) if(dout){printf(__VA_ARGS__);}
+int engine = ENGINE_AUTO; /* selected copy engine */
+size_t blocksize = BLOCKSIZE; /* I/O block size */
+int direct = 0; /* O_DIRECT flag */
+int prealloc = 1; /* fallocate outputs up front */
+int sparse = 0; /* copy data extents only, keeping holes */
+static __thread sigjmp_buf *mmap_jump = NULL; /* set while on a mapping */
+int pipeline = 0; /* pipelined copy ring depth, 0 is off */
+int ring_depth = 0; /* buffers per worker ring, pipeline or io_uring */
+int hash_alg = HASH_XXH64; /* single-pass verify digest */
+unsigned long int chunksize = CHUNKSIZE; /* large file split size, 0 is off */
+int schedule = SCHEDULE_FIFO; /* SCHEDULE_* task order */
+int dev_jobs = 0; /* tasks at a time per device, 0 tunes by device type */
+cpu_set_t cpu_list; /* --cpus, workers are pinned to these round robin */
+int cpu_pin = 0; /* cpu_list is set */
+int numa = 0; /* spread workers over NUMA nodes */
+cpu_set_t node_cpus[NODES_MAX]; /* allowed CPUs of each node with any */
+int node_ids[NODES_MAX];
+int nnodes = 0;
+int fds_held = 0; /* probed inputs kept open for their copy */
+int fds_hold_max = 0; /* budget for fds_held */
+throttle bw_limit = { 0, 0 }; /* bytes per second */
+throttle iops_limit = { 0, 0 }; /* reads and writes per second */
+int control_stop = 0; /* tells the control thread to exit */
+int progress = 0; /* seconds between progress reports, 0 is off */
+workerdata *workers = NULL; /* worker state for the progress reporter */
+int nworkers = 0;
+int files_done = 0; /* file pairs collected, for progress */
+int files_total = 0; /* file pairs queued so far */
+unsigned long int bytes_total = 0; /* input bytes queued so far */
+int stats = STATS_NONE; /* STATS_* per file statistics format */
+int update = 0; /* skip outputs with the size and mtime of their input */
+journalentry *journal = NULL; /* sorted on output and offset */
+int journal_count = 0;
+int journal_fd = -1; /* checkpoint journal appended to, -1 is off */
+int sync_mode = SYNC_NONE; /* SYNC_* durability policy */
+int listen_port = 0; /* receive file pairs on this port, 0 is off */
+const char *net_root = "."; /* receiver outputs go under it */
+const char *net_bind = NET_BIND; /* address --listen accepts on */
+int net_conns = 0; /* senders being served */
+int retries = 0; /* times a failed task is copied again */
+
+/* Indexed by SCHEDULE_* value. */
+static const char *schedule_names[] = { "fifo", "largest", "interleave" };
+
+/* Indexed by SYNC_* value. */
+static const char *sync_names[] = { "none", "file", "batch", "end" };
+#define SYNCS_NUM (int)(sizeof sync_names / sizeof sync_names[0])
+
+/* Indexed by PHASE_* value. */
+static const char *phase_names[] = { "", "open", "read", "write", "sync",
+                                     "verify", "send", "walk" };
+
+/* Workloads and block sizes of --bench. */
+static const benchload bench_loads[] =
+{
+  { "small", 2000, 1024, 65536, 0 },
+  { "huge", 2, 256UL << 20, 256UL << 20, 0 },
+  { "mixed", 200, 1024, 16UL << 20, 0 },
+  { "sparse", 4, 64UL << 20, 64UL << 20, 1 }
+};
+#define BENCH_LOADS_NUM (int)(sizeof bench_loads / sizeof bench_loads[0])
+static const unsigned long int bench_blocks[] = { 4096, 65536, 1048576 };
+#define BENCH_BLOCKS_NUM \
+        (int)(sizeof bench_blocks / sizeof bench_blocks[0])
+
+/* Indexed by LAT_* value. */
+static const char *lat_names[] = { "read", "write", "copy" };
+#define SCHEDULES_NUM (int)(sizeof schedule_names / sizeof schedule_names[0])
 
-/* Making sure these are allocated on heap as opposed to stack. */
-static char ifiles[FILES_MAX][PATH_MAX];
-static char ofiles[FILES_MAX][PATH_MAX];
-static unsigned long int sfiles[FILES_MAX][1];
+/* Indexed by HASH_* value. */
+static const char *hash_names[] = { "xxh64", "crc32c", "blake3" };
+static const int hash_lens[] = { 8, 4, 32 };
+#define HASHES_NUM (int)(sizeof hash_names / sizeof hash_names[0])
+
+/* Indexed by ENGINE_* value. */
+static const copyengine engines[] =
+{
+  { "auto", NULL },
+  { "stdio", engine_stdio },
+  { "cfr", engine_cfr },
+  { "sendfile", engine_sendfile },
+  { "reflink", engine_reflink },
+  { "uring", engine_uring },
+  { "delta", engine_delta },
+  { "mmap", engine_mmap }
+};
+#define ENGINES_NUM (int)(sizeof engines / sizeof engines[0])
+
+/* Order in which auto mode probes engines, stdio always works. */
+static const int engines_auto[] =
+{
+  ENGINE_REFLINK, ENGINE_CFR, ENGINE_SENDFILE, ENGINE_STDIO
+};
+
+/* File pairs to copy, grows with the file count. */
+static filetable ftable = { NULL, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+
+static workqueue wqueue = { NULL, 0, NULL, 0, 0, 0, 1, 0, NULL,
+                            PTHREAD_MUTEX_INITIALIZER,
+                            PTHREAD_COND_INITIALIZER };
+static donequeue dqueue = { NULL, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER,
+                            PTHREAD_COND_INITIALIZER };
+static syncgroup sgroup = { NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
 
 
 int main(int argc, char *argv[])
 {
  const char *PROGTITLE = "threadcopy v0.16 by modrobert@gmail.com in 2021\n";
 
- FILE *infile;
  int inumf = 0;
  int onumf = 0;
- int bnumf = 0;
- int i, opt;
+ int i, opt, e;
  int t_result;
- int t_run;
- int t_complete = 0;
+ int t_jobs = 0;
+ int t_started = 0;
  int cmd_result = 0;
  unsigned long int of_max = 0;
+ unsigned long int bsize;
+ char **ifiles = NULL, **ofiles = NULL;
+ filedata *fd;
+ char *lvalue = NULL; /* file list */
+ int nflag = 0; /* NUL separated file list */
+ int rflag = 0; /* recursive directory copy */
+ char *cvalue = NULL; /* throttle control file */
+ pthread_t control_tid;
+ pthread_t progress_tid;
+ sigset_t sigs;
+ feeder feed;
+ pthread_t feed_tid;
 
  int dflag = 0; /* debug flag */
  int hflag = 0; /* help flag */
  int iflag = 0; /* input files(s) */
+ int jflag = 0; /* worker thread count */
  int oflag = 0; /* output file(s) */
  int qflag = 0; /* quiet flag */
  int vflag = 0; /* verify flag */ 
  char *ivalue = "i", *ovalue = "o";
+ char *mvalue = NULL; /* digest manifest */
+ FILE *manifest = NULL;
+ char *svalue = NULL; /* statistics file */
+ char *bvalue = NULL; /* benchmark directory */
+ char *jvalue = NULL; /* checkpoint journal */
+ int skipped = 0; /* unchanged file pairs */
+ FILE *statsfile = NULL;
+ uint64_t *lat = NULL; /* merged worker histograms */
+ filedata **synced = NULL; /* copied outputs waiting for --sync=end */
+ int nsynced = 0, synced_size = 0;
+ char **also = NULL; /* --also-to outputs, NULL terminated */
+ char ***also_files = NULL; /* the file names of each */
+ char **extra = NULL; /* further outputs of one input */
+ int nalso = 0;
+ int k;
 
- double t_usec;
- double t_sec;
- struct timeval t1, t2;
+ uint64_t t1, t2;
 
  struct rlimit rl;
+ cpu_set_t allowed;
 
- /* Clear buffers. */
- for (i = 0; i < FILES_MAX; i++)
+ static const struct option lopts[] =
  {
-  memset(ifiles[i], 0, PATH_MAX);
-  memset(ofiles[i], 0, PATH_MAX);
-  memset(sfiles[i], 0, sizeof(unsigned long int));
- }
+  { "engine", required_argument, NULL, OPT_ENGINE },
+  { "direct", no_argument, NULL, OPT_DIRECT },
+  { "pipeline", required_argument, NULL, OPT_PIPELINE },
+  { "verify", required_argument, NULL, OPT_VERIFY },
+  { "manifest", required_argument, NULL, OPT_MANIFEST },
+  { "chunk", required_argument, NULL, OPT_CHUNK },
+  { "no-prealloc", no_argument, NULL, OPT_NO_PREALLOC },
+  { "from-file", required_argument, NULL, OPT_FROM_FILE },
+  { "from0", no_argument, NULL, OPT_FROM0 },
+  { "schedule", required_argument, NULL, OPT_SCHEDULE },
+  { "bwlimit", required_argument, NULL, OPT_BWLIMIT },
+  { "iops-limit", required_argument, NULL, OPT_IOPS_LIMIT },
+  { "control", required_argument, NULL, OPT_CONTROL },
+  { "progress", optional_argument, NULL, OPT_PROGRESS },
+  { "stats", required_argument, NULL, OPT_STATS },
+  { "bench", required_argument, NULL, OPT_BENCH },
+  { "update", no_argument, NULL, OPT_UPDATE },
+  { "resume", required_argument, NULL, OPT_RESUME },
+  { "delta", no_argument, NULL, OPT_DELTA },
+  { "sparse", no_argument, NULL, OPT_SPARSE },
+  { "dev-jobs", required_argument, NULL, OPT_DEV_JOBS },
+  { "cpus", required_argument, NULL, OPT_CPUS },
+  { "numa", no_argument, NULL, OPT_NUMA },
+  { "sync", required_argument, NULL, OPT_SYNC },
+  { "listen", required_argument, NULL, OPT_LISTEN },
+  { "root", required_argument, NULL, OPT_ROOT },
+  { "bind", required_argument, NULL, OPT_BIND },
+  { "also-to", required_argument, NULL, OPT_ALSO_TO },
+  { "retry", required_argument, NULL, OPT_RETRY },
+  { NULL, 0, NULL, 0 }
+ };
 
  opterr = 1; /* Turn on getopt '?' error handling. */
 
  /* Handle arguments. */
- while ((opt = getopt (argc, argv, "dhi:o:qv")) != -1)
+ while ((opt = getopt_long(argc, argv, "b:dhi:j:o:qrv", lopts, NULL)) != -1)
  {
   switch (opt)
   {
+   case 'b':
+    if (parse_size(optarg, &bsize) != 0 || bsize < DIRECT_ALIGN ||
+        bsize > BLOCKSIZE_MAX || bsize % DIRECT_ALIGN != 0)
+    {
+     fprintf(stderr, "Block size needs to be a multiple of %d between 4K "
+                     "and 1G: %s\n", DIRECT_ALIGN, optarg);
+     exit(ARG_ERROR);
+    }
+    blocksize = (size_t)bsize;
+    break;
    case 'd':
     dflag = 1;
     dout = 1;
@@ -133,6 +968,15 @@ int main(int argc, char *argv[])
     iflag = 1;
     ivalue = optarg;
     break;
+   case 'j':
+    jflag = 1;
+    t_jobs = atoi(optarg);
+    if (t_jobs < 1 || t_jobs > JOBS_MAX)
+    {
+     fprintf(stderr, "Worker thread count needs to be 1-%d.\n", JOBS_MAX);
+     exit(ARG_ERROR);
+    }
+    break;
    case 'o':
     oflag = 1;
     ovalue = optarg;
@@ -141,21 +985,238 @@ int main(int argc, char *argv[])
     qflag = 1;
     pout = 0;
     break;
+   case 'r':
+    rflag = 1;
+    break;
    case 'v':
-    vflag = 1;
+    vflag = VERIFY_BYTES;
+    break;
+   case OPT_MANIFEST:
+    mvalue = optarg;
+    break;
+   case OPT_VERIFY:
+    if (strcmp(optarg, "bytes") == 0)
+     vflag = VERIFY_BYTES;
+    else if (strcmp(optarg, "single") == 0)
+     vflag = VERIFY_SINGLE;
+    else if (strncmp(optarg, "hash:", 5) == 0)
+    {
+     for (e = 0; e < HASHES_NUM; e++)
+     {
+      if (strcmp(optarg + 5, hash_names[e]) == 0)
+       break;
+     }
+     if (e == HASHES_NUM)
+     {
+      fprintf(stderr, "Unknown verify hash: %s\n", optarg + 5);
+      fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+      exit(ARG_ERROR);
+     }
+     vflag = VERIFY_SINGLE;
+     hash_alg = e;
+    }
+    else
+    {
+     fprintf(stderr, "Unknown verify mode: %s\n", optarg);
+     fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+     exit(ARG_ERROR);
+    }
+    break;
+   case OPT_ENGINE:
+    for (e = 0; e < ENGINES_NUM; e++)
+    {
+     if (strcmp(optarg, engines[e].name) == 0)
+      break;
+    }
+    if (e == ENGINES_NUM)
+    {
+     fprintf(stderr, "Unknown copy engine: %s\n", optarg);
+     fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+     exit(ARG_ERROR);
+    }
+    engine = e;
+    break;
+   case OPT_DIRECT:
+    direct = 1;
+    break;
+   case OPT_FROM_FILE:
+    lvalue = optarg;
+    break;
+   case OPT_FROM0:
+    nflag = 1;
+    break;
+   case OPT_BWLIMIT:
+    if (parse_rate(optarg, &bw_limit.rate) != 0)
+    {
+     fprintf(stderr, "Invalid bandwidth limit: %s\n", optarg);
+     exit(ARG_ERROR);
+    }
+    break;
+   case OPT_IOPS_LIMIT:
+    if (parse_size(optarg, &iops_limit.rate) != 0)
+    {
+     fprintf(stderr, "Invalid IOPS limit: %s\n", optarg);
+     exit(ARG_ERROR);
+    }
+    break;
+   case OPT_CONTROL:
+    cvalue = optarg;
+    break;
+   case OPT_PROGRESS:
+    progress = optarg ? atoi(optarg) : PROGRESS_INTERVAL;
+    if (progress < 1)
+    {
+     fprintf(stderr, "Progress interval needs to be at least 1 second.\n");
+     exit(ARG_ERROR);
+    }
+    break;
+   case OPT_DEV_JOBS:
+    dev_jobs = atoi(optarg);
+    if (dev_jobs < 1 || dev_jobs > JOBS_MAX)
+    {
+     fprintf(stderr, "Tasks per device needs to be 1-%d.\n", JOBS_MAX);
+     exit(ARG_ERROR);
+    }
+    break;
+   case OPT_CPUS:
+    if (parse_cpus(optarg, &cpu_list) != 0)
+    {
+     fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+     exit(ARG_ERROR);
+    }
+    cpu_pin = 1;
+    break;
+   case OPT_NUMA:
+    numa = 1;
+    break;
+   case OPT_LISTEN:
+    listen_port = atoi(optarg);
+    if (listen_port < 1 || listen_port > 65535)
+    {
+     fprintf(stderr, "Listen port needs to be 1-65535.\n");
+     exit(ARG_ERROR);
+    }
+    break;
+   case OPT_ROOT:
+    net_root = optarg;
+    break;
+   case OPT_BIND:
+    net_bind = optarg;
+    break;
+   case OPT_ALSO_TO:
+    if ((also = realloc(also, (size_t)(nalso + 2) * sizeof *also)) == NULL)
+    {
+     fprintf(stderr, "Error allocating output list\n");
+     exit(ARG_ERROR);
+    }
+    also[nalso++] = optarg;
+    also[nalso] = NULL;
+    break;
+   case OPT_RETRY:
+    retries = atoi(optarg);
+    if (retries < 0 || retries > RETRY_MAX)
+    {
+     fprintf(stderr, "Retries need to be 0-%d.\n", RETRY_MAX);
+     exit(ARG_ERROR);
+    }
+    break;
+   case OPT_SYNC:
+    for (e = 0; e < SYNCS_NUM; e++)
+    {
+     if (strcmp(optarg, sync_names[e]) == 0)
+      break;
+    }
+    if (e == SYNCS_NUM)
+    {
+     fprintf(stderr, "Unknown sync policy: %s\n", optarg);
+     fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+     exit(ARG_ERROR);
+    }
+    sync_mode = e;
+    break;
+   case OPT_SPARSE:
+    sparse = 1;
+    break;
+   case OPT_DELTA:
+    engine = ENGINE_DELTA;
+    break;
+   case OPT_UPDATE:
+    update = 1;
+    break;
+   case OPT_RESUME:
+    update = 1;
+    jvalue = optarg;
+    break;
+   case OPT_BENCH:
+    bvalue = optarg;
+    break;
+   case OPT_STATS:
+    if (strncmp(optarg, "json:", 5) == 0)
+     stats = STATS_JSON;
+    else if (strncmp(optarg, "csv:", 4) == 0)
+     stats = STATS_CSV;
+    if (stats == STATS_NONE || optarg[stats == STATS_JSON ? 5 : 4] == '\0')
+    {
+     fprintf(stderr, "Statistics need json:<file> or csv:<file>: %s\n",
+             optarg);
+     fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+     exit(ARG_ERROR);
+    }
+    svalue = optarg + (stats == STATS_JSON ? 5 : 4);
+    break;
+   case OPT_SCHEDULE:
+    for (e = 0; e < SCHEDULES_NUM; e++)
+    {
+     if (strcmp(optarg, schedule_names[e]) == 0)
+      break;
+    }
+    if (e == SCHEDULES_NUM)
+    {
+     fprintf(stderr, "Unknown schedule: %s\n", optarg);
+     fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+     exit(ARG_ERROR);
+    }
+    schedule = e;
+    break;
+   case OPT_NO_PREALLOC:
+    prealloc = 0;
+    break;
+   case OPT_CHUNK:
+    if (parse_size(optarg, &chunksize) != 0)
+    {
+     fprintf(stderr, "Invalid chunk size: %s\n", optarg);
+     exit(ARG_ERROR);
+    }
+    break;
+   case OPT_PIPELINE:
+    pipeline = atoi(optarg);
+    if (pipeline < 2 || pipeline > PIPELINE_MAX)
+    {
+     fprintf(stderr, "Pipeline ring depth needs to be 2-%d.\n", PIPELINE_MAX);
+     exit(ARG_ERROR);
+    }
     break;
    default: /* '?' */ 
-    fprintf(stderr, "Usage: %s -io [-dhqv]\n", argv[0]);
+    fprintf(stderr, "Usage: %s -io [-bdhjqv] | -r <src> <dst>\n", argv[0]);
     fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
     exit(ARG_ERROR);
   }
  }
 
+ /* Statistics on stdout keep it to themselves, status lines go to
+    stderr. */
+ if (svalue && strcmp(svalue, "-") == 0 &&
+     ((statsfile = fdopen(dup(STDOUT_FILENO), "w")) == NULL ||
+      dup2(STDERR_FILENO, STDOUT_FILENO) < 0))
+ {
+  fprintf(stderr, "Error while opening statistics file: %s\n", svalue);
+  exit(WRITE_ERROR);
+ }
  PRINT("%s", PROGTITLE);
 
  if (argc == 1)
  {
-  fprintf(stderr, "Usage: %s -io [-dhqv]\n", argv[0]);
+  fprintf(stderr, "Usage: %s -io [-bdhjqv] | -r <src> <dst>\n", argv[0]);
   fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
   exit(ARG_ERROR);
  }
@@ -163,35 +1224,315 @@ int main(int argc, char *argv[])
  if (hflag)
  {
   PRINT("Function: Copy input files to given output files using pthreads.\n");
-  PRINT("Syntax  : threadcopy [-d] [-h] -i <input file1[" DELIMITER
+  PRINT("Syntax  : threadcopy [-b <size>] [-d] [-h] -i <input file1[" DELIMITER
         "file2" DELIMITER "...]>\n"
-        "          -o <output file1[" DELIMITER "file2" DELIMITER "...]> "
-        "[-q] [-v]\n");
-  PRINT("Options : -d debug enable\n");
+        "          [-j <threads>] -o <output file1[" DELIMITER "file2"
+        DELIMITER "...]>\n"
+        "          [-q] [-r <source dir> <destination dir>] [-v] [--direct]\n"
+        "          [--engine=<engine>] [--chunk=<size>] [--from-file=<list>] "
+        "[--from0]\n"
+        "          [--manifest=<file>] [--no-prealloc] [--pipeline=<depth>]\n"
+        "          [--schedule=<policy>] [--verify=<mode>] [--bwlimit=<rate>]\n"
+        "          [--iops-limit=<n>] [--control=<file>] "
+        "[--progress[=<seconds>]]\n"
+        "          [--stats=<format>:<file>] [--bench=<dir>] [--update]\n"
+        "          [--resume=<journal>] [--delta] [--sparse] "
+        "[--dev-jobs=<n>]\n"
+        "          [--cpus=<list>] [--numa] [--sync=<policy>] "
+        "[--retry=<n>]\n"
+        "          [--also-to=<output file1[|file2|...]>]\n"
+        "          [--listen=<port> [--root=<dir>] [--bind=<addr>]]\n");
+  PRINT("Options : -b I/O block size with optional K, M or G suffix, "
+        "default 4K\n");
+  PRINT("          -d debug enable\n");
   PRINT("          -i input file(s) in order related to output files\n");
-  PRINT("          -o output files(s) in order related to input files\n");
+  PRINT("          -j number of worker threads, default is online CPUs "
+        "or those of --cpus\n");
+  PRINT("          -o output files(s) in order related to input files, "
+        "host:path or\n"
+        "             host:port:path sends to a --listen receiver, one "
+        "connection per\n"
+        "             worker, default port %d\n", NET_PORT);
   PRINT("          -q quiet flag, only errors reported\n");
+  PRINT("          -r copy the contents of a directory tree into destination, "
+        "the\n"
+        "             tree is walked by the workers while they copy\n");
   PRINT("          -v for file verification using byte-for-byte comparison\n");
+  PRINT("          --engine copy engine, one of:\n"
+        "            auto     probe reflink, cfr and sendfile, fall back to "
+        "stdio\n"
+        "            stdio    copy through a userspace buffer\n"
+        "            cfr      in-kernel copy using copy_file_range\n"
+        "            sendfile in-kernel copy using sendfile\n"
+        "            reflink  share extents using the FICLONE ioctl\n"
+        "            uring    asynchronous linked reads and writes using "
+        "io_uring\n"
+        "            delta    read the existing output, rewrite only blocks "
+        "that differ\n"
+        "            mmap     write from a mapping of the input, verify "
+        "compares mappings\n");
+  PRINT("          --direct bypass the page cache using O_DIRECT, stdio or "
+        "uring\n"
+        "            engine only\n");
+  PRINT("          --verify verification mode, one of:\n"
+        "            bytes    reread both files, byte-for-byte, same as -v\n"
+        "            single   digest input during copy, reread output from "
+        "media,\n"
+        "                     stdio or uring engine only\n"
+        "            hash:<h> same as single using hash xxh64 (default), "
+        "crc32c\n"
+        "                     or blake3\n");
+  PRINT("          --chunk split files larger than size into chunks copied "
+        "and verified\n"
+        "            by separate workers, 0 disables, default 1G\n");
+  PRINT("          --from-file read '<input>\\t<output>' lines from list, "
+        "- for stdin,\n"
+        "            instead of -i and -o, copying starts while it is read\n");
+  PRINT("          --from0 list entries are NUL terminated, input then "
+        "output\n");
+  PRINT("          --manifest write input digests of verified files to a "
+        "sidecar\n"
+        "            file as '<digest>  <output file>' lines\n");
+  PRINT("          --no-prealloc don't fallocate output files to the "
+        "input size before\n"
+        "            copying\n");
+  PRINT("          --pipeline overlap reads and writes through a ring of "
+        "2-%d\n"
+        "            buffers, stdio engine, also io_uring depth (default "
+        "%d), the\n"
+        "            rings of all workers are kept within %luM\n",
+        PIPELINE_MAX, URING_DEPTH, RING_MEMORY >> 20);
+  PRINT("          --schedule order in which workers take files, one of:\n"
+        "            fifo       argument or list order (default)\n"
+        "            largest    largest first, files under %dK batched\n"
+        "            interleave alternate between large files and small "
+        "file\n"
+        "                       batches\n", BATCH_SMALL / 1024);
+  PRINT("          --bwlimit limit the bytes all workers read plus write, "
+        "MiB/s or\n"
+        "            bytes/s with K, M or G suffix, 0 is unlimited\n");
+  PRINT("          --iops-limit limit total reads and writes per second\n");
+  PRINT("          --control file with 'bwlimit=<rate>' and "
+        "'iops-limit=<n>' lines,\n"
+        "            reread when changed or on SIGUSR1\n");
+  PRINT("          --progress report throughput, files done, ETA and the "
+        "slowest\n"
+        "            files in flight, every second by default\n");
+  PRINT("          --stats write per file open, copy and verify times, "
+        "failures and read,\n"
+        "            write and in-kernel copy latency histograms as "
+        "json:<file> or\n"
+        "            csv:<file>, - for stdout with status lines on stderr\n");
+  PRINT("          --delta same as --engine=delta, for outputs that mostly "
+        "match the input\n");
+  PRINT("          --sparse copy only data extents found with SEEK_DATA and "
+        "leave holes\n"
+        "            in the output, verify skips them, turns off "
+        "preallocation\n");
+  PRINT("          --dev-jobs tasks at a time on each input or output "
+        "device, default %d\n"
+        "            on rotational disks and unlimited elsewhere\n",
+        DEV_ROTATIONAL_JOBS);
+  PRINT("          --cpus pin workers round robin to the CPUs in a list like "
+        "0-3,8\n");
+  PRINT("          --numa spread workers over NUMA nodes with their buffers "
+        "on their node,\n"
+        "            workers prefer files on devices attached to their "
+        "node\n");
+  PRINT("          --sync when outputs are made durable, one of:\n"
+        "            none  left to the kernel (default)\n"
+        "            file  fdatasync each output and the directory of a new "
+        "one before it\n"
+        "                  is done\n"
+        "            batch start write-back while copying, syncfs the "
+        "filesystems of up\n"
+        "                  to %d finished files, %luM or a second old, "
+        "files are done\n"
+        "                  once synced\n"
+        "            end   start write-back while copying, syncfs each "
+        "output filesystem\n"
+        "                  once at exit, outputs get their --update time "
+        "and manifest\n"
+        "                  line after that\n", SYNC_BATCH_FILES,
+        SYNC_BATCH_BYTES >> 20);
+  PRINT("          --listen receive files sent to host:path outputs on "
+        "port, verify\n"
+        "            digests what was written, runs until killed\n");
+  PRINT("          --root directory --listen writes paths under, default "
+        "the current\n"
+        "            directory, paths with .. or through a symlink are "
+        "refused\n");
+  PRINT("          --bind address --listen accepts senders on, default %s, "
+        "senders are\n"
+        "            not authenticated, serves %d at a time and drops one "
+        "idle for %ds\n", NET_BIND, NET_CONNS_MAX, NET_TIMEOUT);
+  PRINT("          --also-to further outputs in the form of -o, or a "
+        "further -r destination,\n"
+        "            repeatable, the input is read once and written to all, "
+        "an output\n"
+        "            that fails is dropped, each is verified on its own\n");
+  PRINT("          --retry copy a failed file or chunk again up to n times "
+        "on the pool,\n"
+        "            waiting %llus before the first retry and twice as long "
+        "before\n"
+        "            each next one, at most %llus, an input that can't be "
+        "opened is\n"
+        "            retried too unless -r found it, a fan-out copy "
+        "(--also-to) and a\n"
+        "            directory walk that fail are not retried\n",
+        RETRY_BACKOFF_NS / 1000000000ULL, RETRY_BACKOFF_MAX_NS / 1000000000ULL);
+  PRINT("          --update skip outputs with the size and mtime of their "
+        "input, copied\n"
+        "            outputs get the input mtime\n");
+  PRINT("          --resume same as --update, finished chunks are recorded "
+        "in a journal\n"
+        "            so an interrupted run picks up large files where it "
+        "stopped,\n"
+        "            removed once a run succeeds\n");
+  PRINT("          --bench generate small, huge, mixed and sparse file "
+        "workloads in dir\n"
+        "            and copy each with every engine, block size and worker "
+        "count,\n"
+        "            reporting throughput, CPU time and peak RSS, needs about "
+        "1.5G free\n");
   PRINT("Result  : 0 = ok, 1 = read error, 2 = write error,\n"
-        "          3 = verify error, 4 = arg error.\n");
+        "          3 = verify error, 4 = arg error, the worst over all "
+        "file pairs,\n"
+        "          failed ones are listed at exit with phase, errno and "
+        "offset.\n");
   exit(EXIT_OK);
  }
 
- for (i = optind; i < argc; i++)
+ if (bvalue)
+  exit(run_bench(bvalue));
+
+ /* A broken receiver or sender connection is a write or read error. */
+ signal(SIGPIPE, SIG_IGN);
+ if (listen_port)
+  exit(run_listen(listen_port));
+
+ if (rflag && argc - optind != 2)
+ {
+  fprintf(stderr, "Option -r needs a source and a destination directory.\n");
+  fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+  exit(ARG_ERROR);
+ }
+ for (i = optind; !rflag && i < argc; i++)
   PRINT("Ignoring non-option argument: %s\n", argv[i]);
 
+ if (mvalue && vflag != VERIFY_SINGLE)
+ {
+  fprintf(stderr, "Option --manifest needs --verify=single or "
+                  "--verify=hash:<h>.\n");
+  fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+  exit(ARG_ERROR);
+ }
+
+ /* O_DIRECT, pipelining and single-pass verify only make sense for copies
+    through userspace buffers. */
+ if (direct || pipeline || vflag == VERIFY_SINGLE)
+ {
+  if (engine == ENGINE_AUTO)
+   engine = ENGINE_STDIO;
+  if (engine != ENGINE_STDIO && engine != ENGINE_URING &&
+      (engine != ENGINE_DELTA || pipeline) &&
+      (engine != ENGINE_MMAP || pipeline || direct))
+  {
+   fprintf(stderr, "Options --direct, --pipeline and --verify=single need "
+                   "the stdio or\nuring copy engine, delta takes all but "
+                   "--pipeline, mmap only --verify=single.\n");
+   fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+   exit(ARG_ERROR);
+  }
+ }
+
+ /* Faults on a mapped input are turned into read errors. */
+ if (engine == ENGINE_MMAP)
+  signal(SIGBUS, mmap_fault);
+
  /* General sanity checks. */
 
+ if ((lvalue || rflag) && (iflag || oflag))
+ {
+  fprintf(stderr, "Options --from-file and -r replace -i and -o.\n");
+  fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+  exit(ARG_ERROR);
+ }
+ if (lvalue && rflag)
+ {
+  fprintf(stderr, "Options --from-file and -r can't be combined.\n");
+  fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+  exit(ARG_ERROR);
+ }
+ if (nalso && lvalue)
+ {
+  fprintf(stderr, "Option --also-to can't be combined with --from-file.\n");
+  fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+  exit(ARG_ERROR);
+ }
+ if (nflag && !lvalue)
+ {
+  fprintf(stderr, "Option --from0 needs --from-file.\n");
+  fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+  exit(ARG_ERROR);
+ }
+
  /* Check given filenames for dupes and bad combos. */
- if (strcmp(ivalue, ovalue) == 0)
+ if (rflag)
+ {
+  ivalue = argv[optind];
+  ovalue = argv[optind + 1];
+ }
+ if (!lvalue && strcmp(ivalue, ovalue) == 0)
  {
   fprintf(stderr, "Input and output args are same, needs to be unique.\n");
   fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
   exit(ARG_ERROR);
  }
- DPRINT("File arguments: -i %s -o %s\n", ivalue, ovalue);
- inumf = get_filenames(ivalue, ifiles);
- onumf = get_filenames(ovalue, ofiles);
+ if (lvalue)
+ {
+  DPRINT("File list: %s\n", lvalue);
+  memset(&feed, 0, sizeof feed);
+  feed.name = lvalue;
+  feed.delim = nflag ? '\0' : '\n';
+  feed.verify = vflag;
+  if (strcmp(lvalue, "-") == 0)
+   feed.list = stdin;
+  else if ((feed.list = fopen(lvalue, "r")) == NULL)
+  {
+   fprintf(stderr, "Error while opening file list: %s\n", lvalue);
+   exit(READ_ERROR);
+  }
+ }
+ else if (rflag)
+ {
+  DPRINT("Directory arguments: -r %s %s\n", ivalue, ovalue);
+ }
+ else
+ {
+  DPRINT("File arguments: -i %s -o %s\n", ivalue, ovalue);
+  inumf = get_filenames(ivalue, &ifiles);
+  onumf = get_filenames(ovalue, &ofiles);
+  /* Each --also-to is another output list in the order of -o. */
+  if (nalso && ((also_files = calloc((size_t)nalso,
+                                     sizeof *also_files)) == NULL ||
+                (extra = malloc((size_t)(nalso + 1) * sizeof *extra)) ==
+                NULL))
+  {
+   fprintf(stderr, "Error allocating output list\n");
+   exit(ARG_ERROR);
+  }
+  for (k = 0; k < nalso; k++)
+  {
+   if ((int)get_filenames(also[k], &also_files[k]) != inumf)
+   {
+    fprintf(stderr, "Input file count %d does not match --also-to file "
+                    "count: %s\n", inumf, also[k]);
+    fprintf(stderr, "Try '%s -h' for more information.\n", argv[0]);
+    exit(ARG_ERROR);
+   }
+  }
+ }
  if (inumf != onumf)
  {
   fprintf(stderr, "Input file count %d does not match output file "
@@ -204,31 +1545,118 @@ int main(int argc, char *argv[])
   printf("---------------------------\n");
   for (i = 0; i < inumf; i++)
   {
-   printf("i[%04d]: %s  o[%04d]: %s\n", i, &ifiles[i][0], i, &ofiles[i][0]);
+   printf("i[%04d]: %s  o[%04d]: %s\n", i, ifiles[i], i, ofiles[i]);
   }
    printf("---------------------------\n");
  }
- /* Mark missing files and store size. */
+ /* Chunks are planned against chunksize, settle it before queueing. */
+ if (chunksize)
+ {
+  chunksize -= chunksize % blocksize;
+  if (chunksize < blocksize)
+   chunksize = blocksize;
+ }
+ if (mvalue)
+  chunksize = 0;
+ /* Reserved extents would fill the holes back in. */
+ if (sparse)
+  prealloc = 0;
+ /* Probed inputs stay open until copied, use up to a quarter of the open
+    files limit for that. */
+ getrlimit(RLIMIT_NOFILE, &rl);
+ fds_hold_max = rl.rlim_cur / 4 < HOLD_FDS_MAX ? (int)(rl.rlim_cur / 4) :
+                HOLD_FDS_MAX;
+ if (jvalue && load_journal(jvalue) != 0)
+  exit(WRITE_ERROR);
+ /* Queue file pairs given as arguments, workers probe them in parallel
+    and skip missing ones. */
  for (i = 0; i < inumf; i++)
  {
-  infile = fopen(ifiles[i], "r");
-  if (infile == NULL)
+  for (k = 0; k < nalso; k++)
+   extra[k] = also_files[k][i];
+  if (extra)
+   extra[nalso] = NULL;
+  add_file(ifiles[i], ofiles[i], i, vflag, 1, NULL, extra);
+ }
+ free(ifiles);
+ free(ofiles);
+ for (k = 0; also_files && k < nalso; k++)
+  free(also_files[k]);
+ free(also_files);
+ free(extra);
+ /* A directory walk takes the --also-to destinations as they are. */
+ if (rflag && !add_dir(ivalue, ovalue, vflag, NULL, also))
+  exit(READ_ERROR);
+ free(also);
+ /* Main is done producing, the feeder and directory walks close the
+    queue once they finish. */
+ if (lvalue)
+  wqueue.producers++;
+ queue_close(&wqueue, &dqueue);
+ /* Workers are pinned to the listed CPUs or spread over NUMA nodes,
+    using only CPUs the process may run on. */
+ if (cpu_pin || numa)
+ {
+  if (sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+   CPU_ZERO(&allowed);
+  if (cpu_pin)
   {
-   fprintf(stderr, "Input file not found: %s\n", ifiles[i]);
-   fprintf(stderr, "Removing output file: %s\n", ofiles[i]);
-   /* Marking missing files with NULL character... */
-   ifiles[i][0] = '\0';
-   ofiles[i][0] = '\0';
-   /* ...and zero size. */
-   sfiles[i][0] = 0;
-   continue;
+   CPU_AND(&cpu_list, &cpu_list, &allowed);
+   if (CPU_COUNT(&cpu_list) == 0)
+   {
+    fprintf(stderr, "None of the CPUs in --cpus are available.\n");
+    exit(ARG_ERROR);
+   }
+   allowed = cpu_list;
   }
-  sfiles[i][0] = check_file_size(infile);
-  fclose(infile);
+  if (numa && numa_setup(&allowed) == 0)
+   DPRINT("No NUMA nodes found, workers are not placed by node\n");
+ }
+ /* Size the worker pool, never more workers than known tasks. */
+ if (!jflag && cpu_pin)
+  t_jobs = CPU_COUNT(&cpu_list);
+ else if (!jflag)
+ {
+  t_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (t_jobs < 1)
+   t_jobs = 1;
+  if (t_jobs > JOBS_MAX)
+   t_jobs = JOBS_MAX;
+ }
+ if (!lvalue && !rflag && t_jobs > wqueue.queued)
+  t_jobs = wqueue.queued > 0 ? wqueue.queued : 1;
+ DPRINT("Worker threads: %d\n", t_jobs);
+ DPRINT("Copy engine: %s\n", engines[engine].name);
+ DPRINT("Block size: %lu%s\n", (unsigned long int)blocksize,
+        direct ? " (O_DIRECT)" : "");
+ if (engine == ENGINE_URING)
+  ring_depth = pipeline ? pipeline : URING_DEPTH;
+ else
+  ring_depth = pipeline;
+ /* The rings of all workers stay within RING_MEMORY, two buffers is the
+    least one works with. */
+ if (ring_depth > 2 &&
+     (unsigned long int)t_jobs * (unsigned long int)ring_depth * blocksize >
+     RING_MEMORY)
+ {
+  k = (int)(RING_MEMORY / ((unsigned long int)t_jobs * blocksize));
+  ring_depth = k > 2 ? k : 2;
  }
- /* Adjusting max open files limit according to files parsed. */
+ if (ring_depth)
+  DPRINT("Ring depth: %d\n", ring_depth);
+ if (chunksize)
+  DPRINT("Chunk size: %lu\n", chunksize);
+ DPRINT("Schedule: %s\n", schedule_names[schedule]);
+ DPRINT("Sync: %s\n", sync_names[sync_mode]);
+ if (nnodes)
+  DPRINT("NUMA nodes: %d\n", nnodes);
+
+ /* Adjusting max open files limit according to worker count, each worker
+    keeps one input and one output file open, plus its io_uring, on top
+    of the probed inputs held open. */
  getrlimit(RLIMIT_NOFILE, &rl);
- of_max = (unsigned long int)inumf + (unsigned long int)onumf;
+ of_max = (unsigned long int)t_jobs * (engine == ENGINE_URING ? 3 : 2) + 3 +
+          (unsigned long int)fds_hold_max;
  if (rl.rlim_cur < of_max)
  {
   if (of_max > rl.rlim_max)
@@ -242,107 +1670,263 @@ int main(int argc, char *argv[])
   DPRINT("Max open files set to: %lu\n", rl.rlim_cur);
  }
 
+ if (mvalue && (manifest = fopen(mvalue, "w")) == NULL)
+ {
+  fprintf(stderr, "Error while opening manifest file: %s\n", mvalue);
+  exit(WRITE_ERROR);
+ }
+
+ if (svalue && statsfile == NULL &&
+     (statsfile = fopen(svalue, "w")) == NULL)
+ {
+  fprintf(stderr, "Error while opening statistics file: %s\n", svalue);
+  exit(WRITE_ERROR);
+ }
+
+ /* Limits from the control file win, the thread watching it needs
+    SIGUSR1 blocked everywhere else, so that goes before any thread. */
+ if (cvalue)
+ {
+  if (load_control(cvalue) != 0)
+   exit(READ_ERROR);
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+  t_result = pthread_create(&control_tid, NULL, controlThread, cvalue);
+  if (t_result != 0)
+  {
+   fprintf(stderr, "Error creating control thread: %d\n", t_result);
+   exit(READ_ERROR);
+  }
+ }
+ if (bw_limit.rate)
+  DPRINT("Bandwidth limit: %lu bytes/s\n", bw_limit.rate);
+ if (iops_limit.rate)
+  DPRINT("IOPS limit: %lu\n", iops_limit.rate);
+
  /* Start timer. */
- gettimeofday(&t1, NULL);
+ t1 = monotonic_ns();
 
  /* Declaring variable thread buffers. */
- pthread_t tid[inumf];
- filedata fdata[inumf];
-
+ pthread_t tid[t_jobs];
+ workerdata wdata[t_jobs];
  /* Clearing variable thread buffers. */
  memset(tid, 0, sizeof tid);
- memset(fdata, 0, sizeof fdata);
+ memset(wdata, 0, sizeof wdata);
+ if (stats && (lat = calloc((size_t)(t_jobs + 1) * LAT_KINDS * HIST_BUCKETS,
+                            sizeof *lat)) == NULL)
+ {
+  fprintf(stderr, "Error allocating latency histograms\n");
+  exit(READ_ERROR);
+ }
 
- /* Start processing file copy threads. */
+ /* Start worker pool. */
  PRINT("Starting thread processing.\n");
- for (i = 0; i < inumf; i++)
+ for (i = 0; i < t_jobs && (lvalue || wqueue.queued > 0); i++)
  {
-  if (ifiles[i][0] == '\0')
+  wdata[t_started].id = t_started;
+  wdata[t_started].sock = -1;
+  place_worker(&wdata[t_started]);
+  if (lat)
+   wdata[t_started].lat = lat + (size_t)(t_started + 1) * LAT_KINDS *
+                          HIST_BUCKETS;
+  t_result = pthread_create(&tid[t_started], NULL, workerThread,
+                            &wdata[t_started]);
+  if (t_result != 0)
   {
-   DPRINT("Skipped bad file pair thread: [%04d]\n", i);
-   bnumf++;
+   fprintf(stderr, "Error creating worker thread [%4d]: %d\n", i, t_result);
    continue;
   }
-  strncpy(fdata[i].input_name, ifiles[i], PATH_MAX);
-  strncpy(fdata[i].output_name, ofiles[i], PATH_MAX);
-  fdata[i].size = sfiles[i][0];
-  fdata[i].verify = vflag;
-  DPRINT("Creating thread [%04d] with file copy: %s -> %s\n",
-         i, ifiles[i], ofiles[i]);
-  t_result = pthread_create(&tid[i], NULL, copyFile, (void *)&fdata[i]);
+  t_started++;
+ }
+ if (t_started == 0 && (lvalue || wqueue.queued > 0))
+ {
+  fprintf(stderr, "No worker threads could be created.\n");
+  exit(READ_ERROR);
+ }
+ if (progress)
+ {
+  workers = wdata;
+  nworkers = t_started;
+  t_result = pthread_create(&progress_tid, NULL, progressThread, NULL);
   if (t_result != 0)
   {
-   fprintf(stderr, "Error creating thread [%4d]: %d\n", i, t_result);
-   bnumf++;
+   fprintf(stderr, "Error creating progress thread: %d\n", t_result);
+   progress = 0;
   }
-  else
+ }
+
+ if (lvalue)
+ {
+  /* Workers pick up pairs as soon as the feeder queues them. */
+  t_result = pthread_create(&feed_tid, NULL, feedFiles, &feed);
+  if (t_result != 0)
   {
-   fdata[i].status = TS_RUNNING;
+   fprintf(stderr, "Error creating file list thread: %d\n", t_result);
+   exit(READ_ERROR);
   }
+  PRINT("Started %d worker threads reading file list: %s\n", t_started,
+        lvalue);
+ }
+ else if (rflag)
+ {
+  PRINT("Started %d worker threads walking directory: %s\n", t_started,
+        ivalue);
+ }
+ else
+ {
+  PRINT("Started %d worker threads for %d file(s).\n", t_started,
+        inumf);
  }
 
- PRINT("Started %d file copy threads.\n", (inumf - bnumf));
-
- while (!t_complete)
+ /* Collect results as workers finish, blocking until one is ready. */
+ while ((fd = done_pop(&dqueue)) != NULL)
  {
-  t_run = 0;
-  for (i = 0; i < inumf; i++)
+  if (fd->dir)
+  {
+   DPRINT("Walked directory [%04d] in %f second(s): %s -> %s\n", fd->index,
+          fd->time, fd->input_name,
+          fd->output_name);
+   cmd_result = worst_result(cmd_result, fd->result);
+  }
+  else if (fd->skip)
+  {
+   DPRINT("Skipped unchanged file pair [%04d]: %s -> %s\n", fd->index,
+          fd->input_name, fd->output_name);
+   skipped++;
+  }
+  else if (fd->result == EXIT_OK)
   {
-   if (fdata[i].status == TS_RUNNING)
+   if (fd->verify)
    {
-    t_run++;
+    DPRINT("Completed thread [%04d] verified OK in %f second(s) using %s: "
+           "%s -> %s\n", fd->index,
+           fd->time,
+           engines[fd->engine].name, fd->input_name, fd->output_name);
    }
-   else if (ifiles[i][0] == '\0')
+   else
    {
-    /* Skipping bad file pair. */
-    continue;
+    DPRINT("Completed thread [%04d] OK in %f second(s) using %s: "
+           "%s -> %s\n", fd->index,
+           fd->time,
+           engines[fd->engine].name, fd->input_name, fd->output_name);
    }
-   else if (fdata[i].status == TS_DONE)
+   /* With --sync=end an output is only complete once its filesystem
+      is synced at exit. */
+   if (sync_mode == SYNC_END && !fd->remote)
    {
-    if (fdata[i].result == EXIT_OK)
+    if (nsynced == synced_size)
     {
-     if (fdata[i].verify)
-     {
-      DPRINT("Completed thread [%04d] verified OK in %f second(s): %s -> %s\n",
-             i, (double)fdata[i].time_sec + (double)fdata[i].time_usec,
-             ifiles[i], ofiles[i]);
-     }
-     else
+     synced_size = synced_size ? synced_size * 2 : TABLE_SEGMENT;
+     if ((synced = realloc(synced, (size_t)synced_size *
+                           sizeof *synced)) == NULL)
      {
-      DPRINT("Completed thread [%04d] OK in %f second(s): %s -> %s\n",
-             i, (double)fdata[i].time_sec + (double)fdata[i].time_usec,
-             ifiles[i], ofiles[i]);
+      fprintf(stderr, "Error allocating sync list\n");
+      exit(WRITE_ERROR);
      }
     }
-    else
-    {
-     /* TODO: Command exit result code only shows last thread error. */
-     cmd_result = fdata[i].result;
-    }
-    fdata[i].status = TS_CHECKED;
+    synced[nsynced++] = fd;
    }
-  } /* thread exit for loop */
-  if (t_run == 0)
+   else
+    cmd_result = worst_result(cmd_result, file_complete(fd, manifest));
+  }
+  else
+   cmd_result = worst_result(cmd_result, fd->result);
+  fd->status = TS_CHECKED;
+  free(fd->tasks);
+  fd->tasks = NULL;
+ } /* completion loop */
+ if (lvalue)
+ {
+  pthread_join(feed_tid, NULL);
+  if (feed.list != stdin)
+   fclose(feed.list);
+  DPRINT("Read %d file pair(s) from list, skipped %d\n", feed.queued,
+         feed.skipped);
+  cmd_result = worst_result(cmd_result, feed.result);
+ }
+ for (i = 0; i < t_started; i++)
+  pthread_join(tid[i], NULL);
+ cmd_result = worst_result(cmd_result, dir_modes());
+ if (nsynced && sync_outputs(synced, nsynced) != 0)
+  cmd_result = worst_result(cmd_result, WRITE_ERROR);
+ for (k = 0; k < nsynced; k++)
+ {
+  if (synced[k]->result == EXIT_OK)
+   cmd_result = worst_result(cmd_result, file_complete(synced[k], manifest));
+ }
+ free(synced);
+ cmd_result = worst_result(cmd_result, report_failures());
+ if (progress)
+ {
+  __atomic_store_n(&progress, 0, __ATOMIC_RELAXED);
+  pthread_join(progress_tid, NULL);
+ }
+ if (cvalue)
+ {
+  __atomic_store_n(&control_stop, 1, __ATOMIC_RELAXED);
+  pthread_kill(control_tid, SIGUSR1);
+  pthread_join(control_tid, NULL);
+ }
+ if (statsfile)
+ {
+  /* Fold the worker histograms into the first slot. */
+  for (i = 0; i < t_started; i++)
+  {
+   for (k = 0; k < LAT_KINDS * HIST_BUCKETS; k++)
+    lat[k] += wdata[i].lat[k];
+  }
+  if (write_stats(statsfile, lat, elapsed(t1, monotonic_ns())) != 0 ||
+      fclose(statsfile) != 0)
   {
-   t_complete = 1;
+   fprintf(stderr, "Error while writing statistics file: %s\n", svalue);
+   cmd_result = worst_result(cmd_result, WRITE_ERROR);
   }
-  /* Sleep for UWAIT micro seconds. */
-  usleep(UWAIT);
- } /* thread exit while loop */
+  free(lat);
+ }
+ for (i = 0; i < wqueue.nqueues; i++)
+ {
+  free(wqueue.queues[i].lanes[0].items);
+  free(wqueue.queues[i].lanes[1].items);
+ }
+ free(wqueue.queues);
+ free(wqueue.devices);
+ free(dqueue.items);
+ table_free(&ftable);
+ if (manifest && fclose(manifest) != 0)
+ {
+  fprintf(stderr, "Error while writing manifest file: %s\n", mvalue);
+  cmd_result = worst_result(cmd_result, WRITE_ERROR);
+ }
+ if (jvalue)
+ {
+  /* Finished outputs carry their input mtime, the journal is only
+     needed to pick up after a failed run. */
+  close(journal_fd);
+  if (cmd_result == EXIT_OK)
+   unlink(jvalue);
+  for (i = 0; i < journal_count; i++)
+   free(journal[i].output);
+  free(journal);
+ }
+ if (skipped)
+  PRINT("Skipped %d unchanged file pair(s).\n", skipped);
  DPRINT("Exit with result: %d\n", cmd_result);
  /* End timer. */
- gettimeofday(&t2, NULL);
- t_usec = (double) (t2.tv_usec - t1.tv_usec) / 1000000;
- t_sec = (double) (t2.tv_sec - t1.tv_sec);
- if (vflag)
+ t2 = monotonic_ns();
+ if (cmd_result != EXIT_OK)
+ {
+  PRINT("Finished with failures in %f second(s).\n", elapsed(t1, t2));
+ }
+ else if (vflag)
  {
   PRINT("All files copied and verified in %f second(s).\n",
-        (double)t_sec + (double)t_usec);
+        elapsed(t1, t2));
  }
  else
  {
   PRINT("All files copied in %f second(s).\n",
-        (double)t_sec + (double)t_usec);
+        elapsed(t1, t2));
  }
  return (cmd_result);
 } /* main */
@@ -352,187 +1936,5349 @@ int main(int argc, char *argv[])
 
 void *copyFile(void *arg)
 {
- filedata *fdata = (filedata *)arg;
+ copytask *task = (copytask *)arg;
+ filedata *fdata = task->fdata;
+ workerdata *wdata = task->worker;
+ int whole = task->length == COPY_TO_EOF;
 
- FILE *infile, *outfile;
- unsigned long int filesize = fdata->size;
- int bytes_read;
- int bytes_write;
- unsigned char ibuffer[BLOCKSIZE];
- unsigned char obuffer[BLOCKSIZE];
- int i;
+ filedata *r;
+ int infd, outfd;
+ int outfds[fdata->replicas + 1];
+ int result, rresult, k;
+ struct stat st;
+ uint64_t start = monotonic_ns(), now;
+
+ /* Opening files for copy, the probe may have left the input open,
+    chunks write into the presized output. */
+ task->open_ns = task->copy_ns = task->verify_ns = 0;
+ task->phase = PHASE_NONE;
+ task->err = 0;
+ errno = 0;
+ for (k = 0; k <= fdata->replicas; k++)
+  outfds[k] = -1;
+ task->outfds = outfds;
+ if ((infd = fdata->infd) >= 0)
+ {
+  fdata->infd = -1;
+  __atomic_sub_fetch(&fds_held, 1, __ATOMIC_RELAXED);
+ }
+ else if ((infd = open_direct(fdata->input_name, O_RDONLY)) < 0)
+ {
+  task_failed(task, PHASE_OPEN);
+  fprintf(stderr, "Error while opening input file: %s\n", fdata->input_name);
+  task->result = READ_ERROR;
+  replicas_close(task, READ_ERROR);
+  return NULL;
+ }
+ if (fdata->remote)
+ {
+  /* The receiver writes and verifies, it has no output here. */
+  now = monotonic_ns();
+  task->open_ns = now - start;
+  task->outfd = -1;
+  if ((task->result = copy_remote(task, infd)) != EXIT_OK)
+   task_failed(task, PHASE_SEND);
+  close(infd);
+  task->copy_ns = monotonic_ns() - now;
+  if (fdata->replicas)
+  {
+   fprintf(stderr, "Fan-out to a remote output is not supported: %s\n",
+           fdata->output_name);
+   errno = EOPNOTSUPP;
+   for (r = fdata->replica; r != NULL; r = r->replica)
+    replica_result(r, task, WRITE_ERROR, PHASE_OPEN);
+  }
+  return NULL;
+ }
+ if (sync_mode == SYNC_FILE && whole &&
+     access(fdata->output_name, F_OK) != 0)
+  fdata->created = 1;
+ if ((outfd = open_direct(fdata->output_name,
+                          engine == ENGINE_DELTA && !fdata->replicas ?
+                          (whole ? O_RDWR | O_CREAT : O_RDWR) : whole ?
+                          O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY)) < 0)
+ {
+  task_failed(task, PHASE_OPEN);
+  fprintf(stderr, "Error while opening output file: %s\n", fdata->output_name);
+  /* The replicas of a fan-out copy go on without it. */
+  if (!fdata->replicas)
+  {
+   task->result = WRITE_ERROR;
+   close(infd);
+   return NULL;
+  }
+ }
+ if (!whole && (lseek(infd, (off_t)task->offset, SEEK_SET) < 0 ||
+                (outfd >= 0 &&
+                 lseek(outfd, (off_t)task->offset, SEEK_SET) < 0)))
+ {
+  task_failed(task, PHASE_OPEN);
+  fprintf(stderr, "Error while seeking in file: %s -> %s\n",
+          fdata->input_name, fdata->output_name);
+  task->result = READ_ERROR;
+  close(infd);
+  if (outfd >= 0)
+   close(outfd);
+  replicas_close(task, READ_ERROR);
+  return NULL;
+ }
+ posix_fadvise(infd, (off_t)task->offset, whole ? 0 : (off_t)task->length,
+               POSIX_FADV_SEQUENTIAL);
+ task->outfd = outfd;
+ task->unflushed = 0;
+ replicas_open(task, whole);
+ now = monotonic_ns();
+ task->open_ns = now - start;
+ start = now;
+
+ /* Copy file, the replicas of a fan-out copy only share a read error
+    of the input. */
+ if (fdata->verify == VERIFY_SINGLE)
+  hash_init(&wdata->vhash, hash_alg);
+ if (fdata->replicas)
+ {
+  task->engine = ENGINE_STDIO;
+  result = copy_fanout(task, infd, outfd);
+  rresult = result == READ_ERROR ? READ_ERROR : EXIT_OK;
+ }
+ else
+  result = rresult = sparse ? copy_sparse(task, infd, outfd) :
+                     copy_engine(task, infd, outfd);
+ if (result != EXIT_OK)
+  task_failed(task, result == READ_ERROR ? PHASE_READ :
+              result == VERIFY_ERROR ? PHASE_VERIFY : PHASE_WRITE);
+ /* Give back preallocated blocks past the end of an input that shrank. */
+ if (result == EXIT_OK && whole && prealloc && task->engine != ENGINE_REFLINK &&
+     fstat(outfd, &st) == 0 && (unsigned long int)st.st_size < fdata->size &&
+     ftruncate(outfd, st.st_size) != 0)
+ {
+  task_failed(task, PHASE_WRITE);
+  fprintf(stderr, "Error while truncating output file: %s\n",
+          fdata->output_name);
+  result = WRITE_ERROR;
+ }
+ /* The rest of the task is on its way to the media before the batch or
+    exit sync waits for it. */
+ if (result == EXIT_OK && sync_mode >= SYNC_BATCH)
+  sync_file_range(outfd, (off_t)task->offset,
+                  whole ? 0 : (off_t)task->length, SYNC_FILE_RANGE_WRITE);
+ if (result == EXIT_OK && (sync_mode == SYNC_FILE ||
+                           (!whole && journal_fd >= 0)) &&
+     fdata->verify != VERIFY_SINGLE && fdatasync(outfd) != 0)
+ {
+  /* A journaled chunk has to be on the media first. */
+  task_failed(task, PHASE_SYNC);
+  fprintf(stderr, "Error while syncing output file: %s\n",
+          fdata->output_name);
+  result = WRITE_ERROR;
+ }
+ if (fdata->verify == VERIFY_SINGLE)
+  hash_final(&wdata->vhash, task->digest);
+ if (result == EXIT_OK && fdata->verify == VERIFY_SINGLE)
+ {
+  /* Readback has to come from the media, not from the page cache. */
+  if (fdatasync(outfd) != 0)
+  {
+   task_failed(task, PHASE_SYNC);
+   fprintf(stderr, "Error while syncing output file: %s\n",
+           fdata->output_name);
+   result = WRITE_ERROR;
+  }
+  posix_fadvise(outfd, (off_t)task->offset,
+                whole ? 0 : (off_t)task->length, POSIX_FADV_DONTNEED);
+ }
+ /* Chunks of a file leave its directory to prepare_chunks. */
+ if (result == EXIT_OK && whole && fdata->created &&
+     sync_parent(fdata->output_name) != 0)
+ {
+  task_failed(task, PHASE_SYNC);
+  fprintf(stderr, "Error while syncing directory of output file: %s\n",
+          fdata->output_name);
+  result = WRITE_ERROR;
+ }
+ replicas_close(task, rresult);
+ close(infd);
+ task->outfd = -1;
+ if (outfd >= 0 && close(outfd) != 0 && result == EXIT_OK)
+ {
+  task_failed(task, PHASE_SYNC);
+  fprintf(stderr, "Error while writing output file: %s\n",
+          fdata->output_name);
+  result = WRITE_ERROR;
+ }
+ now = monotonic_ns();
+ task->copy_ns = now - start;
+ start = now;
+
+ /* Each output is verified on its own. */
+ if (result == EXIT_OK)
+ {
+  errno = 0;
+  if (fdata->verify == VERIFY_BYTES)
+   result = task->engine == ENGINE_MMAP ? verify_mapped(task) :
+            verify_bytes(task);
+  else if (fdata->verify == VERIFY_SINGLE)
+   result = verify_readback(task);
+  if (result != EXIT_OK)
+   task_failed(task, PHASE_VERIFY);
+ }
+ if (rresult == EXIT_OK && fdata->verify != VERIFY_NONE)
+  replicas_verify(task);
+ if (fdata->verify != VERIFY_NONE)
+  task->verify_ns = monotonic_ns() - start;
+
+ task->result = result;
+ return NULL;
+} /* copyFile */
+
+/* Create the destination at full size up front so chunks can be written
+   in any order, falls back to a whole file copy on failure. Clones share
+   extents, so only other engines get the space reserved. With keep the
+   existing contents stay in place for the journal or the delta engine. */
+int prepare_chunks(filedata *fdata, int keep)
+{
+ int outfd;
+ int created = sync_mode == SYNC_FILE && !keep &&
+               access(fdata->output_name, F_OK) != 0;
+ int result = 0;
+
+ if ((outfd = open(fdata->output_name, keep ? O_WRONLY | O_CREAT :
+                   O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+  return -1;
+ if (keep && ftruncate(outfd, (off_t)fdata->size) != 0)
+  result = -1;
+ if (!(prealloc && engine != ENGINE_REFLINK && engine != ENGINE_AUTO &&
+       fallocate(outfd, 0, 0, (off_t)fdata->size) == 0) &&
+     ftruncate(outfd, (off_t)fdata->size) != 0)
+  result = -1;
+ if (close(outfd) != 0)
+  result = -1;
+ /* The new name is synced once here instead of by every chunk. When that
+    fails the file is copied whole, which syncs it again. */
+ if (created && result == 0 && sync_parent(fdata->output_name) != 0)
+  result = -1;
+ if (created && result != 0)
+  fdata->created = 1;
+ return result;
+} /* prepare_chunks */
+
+/* Read chunks finished by an earlier run and open the journal for this
+   one. A line is '<mtime> <size> <offset> <length> <output>', a torn
+   last line from a crash is ignored. Returns 0 on success. */
+int load_journal(const char *name)
+{
+ FILE *fp;
+ char *line = NULL;
+ size_t line_size = 0;
+ ssize_t len;
+ journalentry entry;
+ long long int sec;
+ long int nsec;
+ int pos, size = 0;
+
+ if ((fp = fopen(name, "r")) != NULL)
+ {
+  while ((len = getline(&line, &line_size, fp)) > 0)
+  {
+   if (line[len - 1] != '\n')
+    break;
+   line[len - 1] = '\0';
+   if (sscanf(line, "%lld.%ld %lu %lu %lu %n", &sec, &nsec, &entry.size,
+              &entry.offset, &entry.length, &pos) != 5 || line[pos] == '\0')
+    continue;
+   entry.mtime.tv_sec = (time_t)sec;
+   entry.mtime.tv_nsec = nsec;
+   if (journal_count == size)
+   {
+    size = size ? size * 2 : TABLE_SEGMENT;
+    if ((journal = realloc(journal, (size_t)size * sizeof *journal)) == NULL)
+    {
+     fprintf(stderr, "Error allocating checkpoint journal\n");
+     exit(READ_ERROR);
+    }
+   }
+   if ((entry.output = strdup(line + pos)) == NULL)
+   {
+    fprintf(stderr, "Error allocating checkpoint journal\n");
+    exit(READ_ERROR);
+   }
+   journal[journal_count++] = entry;
+  }
+  free(line);
+  fclose(fp);
+  qsort(journal, (size_t)journal_count, sizeof *journal, journal_cmp);
+  DPRINT("Loaded %d finished chunk(s) from journal: %s\n", journal_count,
+         name);
+ }
+ if ((journal_fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0)
+ {
+  fprintf(stderr, "Error while opening checkpoint journal: %s\n", name);
+  return -1;
+ }
+ return 0;
+} /* load_journal */
+
+int journal_cmp(const void *a, const void *b)
+{
+ const journalentry *x = (const journalentry *)a;
+ const journalentry *y = (const journalentry *)b;
+ int c = strcmp(x->output, y->output);
+
+ if (c != 0)
+  return c;
+ return x->offset < y->offset ? -1 : x->offset > y->offset;
+} /* journal_cmp */
 
- struct timeval t1, t2;
+/* Whether a chunk was finished from the same input by an earlier run. */
+int journal_done(const filedata *fdata, unsigned long int offset,
+                 unsigned long int length)
+{
+ journalentry key;
+ const journalentry *found;
+
+ key.output = fdata->output_name;
+ key.offset = offset;
+ found = bsearch(&key, journal, (size_t)journal_count, sizeof *journal,
+                 journal_cmp);
+ return found != NULL && found->length == length &&
+        found->size == fdata->size &&
+        found->mtime.tv_sec == fdata->mtime.tv_sec &&
+        found->mtime.tv_nsec == fdata->mtime.tv_nsec;
+} /* journal_done */
 
- /* Reset time. */
- fdata->time_usec = 0;
- fdata->time_sec = 0;
+/* Record a finished chunk, its data was synced by copyFile. Appends are
+   a single write each and synced, so the journal survives a crash. */
+void journal_add(copytask *task)
+{
+ filedata *fdata = task->fdata;
+ char *line;
+ int len;
 
- /* Start timing thread. */
- gettimeofday(&t1, NULL);
+ len = asprintf(&line, "%lld.%09ld %lu %lu %lu %s\n",
+                (long long int)fdata->mtime.tv_sec, fdata->mtime.tv_nsec,
+                fdata->size, task->offset, task->length, fdata->output_name);
+ if (len < 0)
+  return;
+ if (write(journal_fd, line, (size_t)len) != len || fdatasync(journal_fd) != 0)
+  fprintf(stderr, "Error while writing checkpoint journal for: %s\n",
+          fdata->output_name);
+ free(line);
+} /* journal_add */
 
- /* Clear buffers. */
- memset(ibuffer, 0, BLOCKSIZE);
- memset(obuffer, 0, BLOCKSIZE);
+/* Verify by reading back both files and comparing byte-for-byte. */
+int verify_bytes(copytask *task)
+{
+ filedata *fdata = task->fdata;
+ int infd, outfd;
+ ssize_t bytes_read;
+ unsigned char *ibuffer = task->worker->ibuffer;
+ unsigned char *obuffer = task->worker->obuffer;
+ unsigned long int offset = task->offset;
+ unsigned long int left = task->length;
+ unsigned long int span = COPY_TO_EOF, hole, next;
+ size_t i, len;
+ int result = EXIT_OK;
 
- /* Opening files for copy. */
- if ((infile = fopen(fdata->input_name, "r")) == NULL)
+ /* Opening files for verification. */
+ if ((infd = open_direct(fdata->input_name, O_RDONLY)) < 0)
  {
   fprintf(stderr, "Error while opening input file: %s\n", fdata->input_name);
-  fdata->status = TS_DONE;
-  fdata->result = READ_ERROR;
-  pthread_exit(NULL);
+  return READ_ERROR;
  }
- if ((outfile = fopen(fdata->output_name, "w")) == NULL)
+ if ((outfd = open_direct(fdata->output_name, O_RDONLY)) < 0)
  {
-  fprintf(stderr, "Error while opening output file: %s\n", fdata->output_name);
-  fdata->status = TS_DONE;
-  fdata->result = WRITE_ERROR;
-  fclose(infile);
-  pthread_exit(NULL);
+  fprintf(stderr, "Error while opening output file: %s\n",
+          fdata->output_name);
+  close(infd);
+  return READ_ERROR;
+ }
+ if (offset && (lseek(infd, (off_t)offset, SEEK_SET) < 0 ||
+                lseek(outfd, (off_t)offset, SEEK_SET) < 0))
+ {
+  fprintf(stderr, "Error while seeking in file: %s -> %s\n",
+          fdata->input_name, fdata->output_name);
+  close(infd);
+  close(outfd);
+  return READ_ERROR;
  }
 
- /* Copy file. */
- while (!feof(infile))
+ /* Read input and output files, holes the copy left in both are
+    skipped. */
+ if (sparse)
  {
-  if ((bytes_read = fread(ibuffer, 1, BLOCKSIZE, infile)) <= 0)
+  if (left == COPY_TO_EOF)
+   left = fdata->size > offset ? fdata->size - offset : 0;
+  span = 0;
+ }
+ while (left > 0)
+ {
+  if (span == 0)
   {
-   if (feof(infile)) break;
-   fprintf(stderr, "Error while reading input file: %s\n", fdata->input_name);
-   fdata->status = TS_DONE;
-   fdata->result = READ_ERROR;
-   fclose(infile);
-   fclose(outfile);
-   pthread_exit(NULL);
+   next = offset;
+   span = data_extent(infd, &next, offset + left);
+   hole = offset;
+   if (next > offset && data_extent(outfd, &hole, next) == 0)
+   {
+    left -= next - offset;
+    offset = next;
+    if (span == 0 || lseek(infd, (off_t)offset, SEEK_SET) < 0 ||
+        lseek(outfd, (off_t)offset, SEEK_SET) < 0)
+     break;
+   }
+   else if (next > offset)
+   {
+    /* Output has data where the input has none, compare it. */
+    span = next - offset;
+   }
   }
-  bytes_write = bytes_read;
-  if (fwrite(ibuffer, 1, bytes_write, outfile) != bytes_write)
+  len = left < blocksize ? (size_t)left : blocksize;
+  if (len > span)
+   len = (size_t)span;
+  if ((bytes_read = read_full(infd, ibuffer, len, NULL)) <= 0)
   {
-   fprintf(stderr, "Error while writing output file: %s\n",
-           fdata->output_name);
-   fdata->status = TS_DONE;
-   fdata->result = WRITE_ERROR;
-   fclose(infile);
-   fclose(outfile);
-   pthread_exit(NULL);
+   if (bytes_read == 0) break;
+   fprintf(stderr, "Error while reading input file: %s\n", fdata->input_name);
+   result = READ_ERROR;
+   break;
   }
- } /* while !feof */
- fclose(infile);
- fclose(outfile);
-
- if (fdata->verify)
- {
-  /* Opening files for verification. */
-  if ((infile = fopen(fdata->input_name, "r")) == NULL)
+  if (read_full(outfd, obuffer, (size_t)bytes_read, NULL) != bytes_read)
   {
-   fprintf(stderr, "Error while opening input file: %s\n", fdata->input_name);
-   fdata->status = TS_DONE;
-   fdata->result = READ_ERROR;
-   pthread_exit(NULL);
+   fprintf(stderr, "Error while reading output file: %s\n",
+           fdata->output_name);
+   result = READ_ERROR;
+   break;
   }
-  if ((outfile = fopen(fdata->output_name, "r")) == NULL)
+  /* Compare read buffers. */
+  i = compare_block(ibuffer, obuffer, (size_t)bytes_read);
+  if (i < (size_t)bytes_read)
   {
-   fprintf(stderr, "Error while opening output file: %s\n",
+   fprintf(stderr, "Verification failed at offset %lu: %s != %s\n",
+           offset + (unsigned long int)i, fdata->input_name,
            fdata->output_name);
-   fdata->status = TS_DONE;
-   fdata->result = READ_ERROR;
-   fclose(infile);
-   pthread_exit(NULL);
+   result = VERIFY_ERROR;
+   break;
   }
+  offset += (unsigned long int)bytes_read;
+  if (left != COPY_TO_EOF)
+   left -= (unsigned long int)bytes_read;
+  if (span != COPY_TO_EOF)
+   span -= (unsigned long int)bytes_read;
+ } /* for read blocks */
+ close(infd);
+ close(outfd);
+ return result;
+} /* verify_bytes */
+
+/* Verify a copy made by the mmap engine by comparing two mappings. */
+int verify_mapped(copytask *task)
+{
+ filedata *fdata = task->fdata;
+ int whole = task->length == COPY_TO_EOF;
+ int infd, outfd;
+ struct stat ist, ost;
+ unsigned long int end, base;
+ volatile unsigned long int pos = task->offset;
+ size_t page = (size_t)sysconf(_SC_PAGESIZE);
+ unsigned char *volatile imap = NULL;
+ unsigned char *volatile omap = NULL;
+ volatile size_t maplen = 0;
+ sigjmp_buf jump;
+ size_t i;
+ int result = EXIT_OK;
+
+ if ((infd = open(fdata->input_name, O_RDONLY)) < 0)
+ {
+  fprintf(stderr, "Error while opening input file: %s\n", fdata->input_name);
+  return READ_ERROR;
+ }
+ if ((outfd = open(fdata->output_name, O_RDONLY)) < 0)
+ {
+  fprintf(stderr, "Error while opening output file: %s\n",
+          fdata->output_name);
+  close(infd);
+  return READ_ERROR;
+ }
+ if (fstat(infd, &ist) != 0 || fstat(outfd, &ost) != 0)
+ {
+  fprintf(stderr, "Error while reading file size: %s -> %s\n",
+          fdata->input_name, fdata->output_name);
+  close(infd);
+  close(outfd);
+  return READ_ERROR;
+ }
+ end = whole ? (unsigned long int)ist.st_size : task->offset + task->length;
+ if (whole && ist.st_size != ost.st_size)
+ {
+  fprintf(stderr, "Verification failed, sizes differ: %s != %s\n",
+          fdata->input_name, fdata->output_name);
+  result = VERIFY_ERROR;
+ }
 
-  /* Read input and output files. */
-  while (!feof(infile))
+ while (result == EXIT_OK && pos < end)
+ {
+  base = pos - pos % page;
+  maplen = end - base < MMAP_WINDOW ? (size_t)(end - base) : MMAP_WINDOW;
+  imap = mmap(NULL, maplen, PROT_READ, MAP_SHARED, infd, (off_t)base);
+  omap = mmap(NULL, maplen, PROT_READ, MAP_SHARED, outfd, (off_t)base);
+  if (imap == MAP_FAILED || omap == MAP_FAILED)
+  {
+   fprintf(stderr, "Error while mapping file: %s -> %s\n",
+           fdata->input_name, fdata->output_name);
+   result = READ_ERROR;
+  }
+  else if (sigsetjmp(jump, 1) != 0)
   {
-   if ((bytes_read = fread(ibuffer, 1, BLOCKSIZE, infile)) <= 0)
+   /* A fault past the end of a short output is a mismatch. */
+   if (fstat(outfd, &ost) == 0 && (unsigned long int)ost.st_size < end)
    {
-    if (feof(infile)) break;
-    fprintf(stderr, "Error while reading input file: %s\n", fdata->input_name);
-    fdata->status = TS_DONE;
-    fdata->result = READ_ERROR;
-    fclose(infile);
-    fclose(outfile);
-    pthread_exit(NULL);
+    fprintf(stderr, "Verification failed, output is short: %s != %s\n",
+            fdata->input_name, fdata->output_name);
+    result = VERIFY_ERROR;
    }
-   if (fread(obuffer, 1, bytes_read, outfile) != bytes_read)
+   else
    {
-    fprintf(stderr, "Error while reading output file: %s\n",
+    fprintf(stderr, "Error while reading mapped file: %s -> %s\n",
+            fdata->input_name, fdata->output_name);
+    result = READ_ERROR;
+   }
+  }
+  else
+  {
+   mmap_jump = &jump;
+   madvise(imap, maplen, MADV_SEQUENTIAL);
+   madvise(omap, maplen, MADV_SEQUENTIAL);
+   i = compare_block(imap + (pos - base), omap + (pos - base),
+                     maplen - (size_t)(pos - base));
+   if (i < maplen - (size_t)(pos - base))
+   {
+    fprintf(stderr, "Verification failed at offset %lu: %s != %s\n",
+            pos + (unsigned long int)i, fdata->input_name,
             fdata->output_name);
-    fdata->status = TS_DONE;
-    fdata->result = READ_ERROR;
-    fclose(infile);
-    fclose(outfile);
-    pthread_exit(NULL);
+    result = VERIFY_ERROR;
    }
-   /* Compare read buffers. */
-   for (i = 0; i < bytes_read; i++)
+  }
+  mmap_jump = NULL;
+  if (imap != MAP_FAILED)
+   munmap(imap, maplen);
+  if (omap != MAP_FAILED)
+   munmap(omap, maplen);
+  pos = base + maplen;
+ }
+ close(infd);
+ close(outfd);
+ return result;
+} /* verify_mapped */
+
+/* Verify by reading back only the output file and comparing it against
+   the digest of the input stream taken during the copy. */
+int verify_readback(copytask *task)
+{
+ filedata *fdata = task->fdata;
+ int outfd;
+ ssize_t bytes_read;
+ unsigned char *obuffer = task->worker->obuffer;
+ unsigned long int left = task->length;
+ unsigned long int offset = task->offset, span = COPY_TO_EOF, next;
+ size_t len;
+ hashstate state;
+ unsigned char digest[HASH_MAX];
+ int result = EXIT_OK;
+
+ if ((outfd = open_direct(fdata->output_name, O_RDONLY)) < 0)
+ {
+  fprintf(stderr, "Error while opening output file: %s\n",
+          fdata->output_name);
+  return READ_ERROR;
+ }
+ if (task->offset && lseek(outfd, (off_t)task->offset, SEEK_SET) < 0)
+ {
+  fprintf(stderr, "Error while seeking in file: %s\n", fdata->output_name);
+  close(outfd);
+  return READ_ERROR;
+ }
+ posix_fadvise(outfd, (off_t)task->offset,
+               left == COPY_TO_EOF ? 0 : (off_t)left, POSIX_FADV_SEQUENTIAL);
+ hash_init(&state, hash_alg);
+ /* Holes read as zeros, they are digested without reading them. */
+ if (sparse)
+ {
+  if (left == COPY_TO_EOF)
+   left = fdata->size > offset ? fdata->size - offset : 0;
+  span = 0;
+ }
+ while (left > 0)
+ {
+  if (span == 0)
+  {
+   next = offset;
+   span = data_extent(outfd, &next, offset + left);
+   if (next > offset)
    {
-    if (ibuffer[i] != obuffer[i])
-    {
-     fprintf(stderr, "Verification failed: %s != %s\n",
-             fdata->input_name, fdata->output_name);
-     fdata->status = TS_DONE;
-     fdata->result = VERIFY_ERROR;
-     fclose(infile);
-     fclose(outfile);
-     pthread_exit(NULL);
-    }
+    hash_zeros(&state, obuffer, next - offset);
+    left -= next - offset;
+    offset = next;
+    if (span == 0 || lseek(outfd, (off_t)offset, SEEK_SET) < 0)
+     break;
    }
-  } /* while !feof */
-  fclose(infile);
-  fclose(outfile);
- } /* if verify */
+  }
+  len = left < blocksize ? (size_t)left : blocksize;
+  if (len > span)
+   len = (size_t)span;
+  if ((bytes_read = read_full(outfd, obuffer, len, NULL)) <= 0)
+  {
+   if (bytes_read == 0) break;
+   fprintf(stderr, "Error while reading output file: %s\n",
+           fdata->output_name);
+   result = READ_ERROR;
+   break;
+  }
+  hash_update(&state, obuffer, (size_t)bytes_read);
+  offset += (unsigned long int)bytes_read;
+  if (left != COPY_TO_EOF)
+   left -= (unsigned long int)bytes_read;
+  if (span != COPY_TO_EOF)
+   span -= (unsigned long int)bytes_read;
+ }
+ /* Don't leave the readback in the page cache either. */
+ posix_fadvise(outfd, (off_t)task->offset,
+               task->length == COPY_TO_EOF ? 0 : (off_t)task->length,
+               POSIX_FADV_DONTNEED);
+ close(outfd);
+ hash_final(&state, digest);
+ if (result == EXIT_OK &&
+     memcmp(digest, task->digest, (size_t)hash_lens[hash_alg]) != 0)
+ {
+  if (task->length == COPY_TO_EOF)
+   fprintf(stderr, "Verification failed: %s != %s\n",
+           fdata->input_name, fdata->output_name);
+  else
+   fprintf(stderr, "Verification failed in chunk at offset %lu: %s != %s\n",
+           task->offset, fdata->input_name, fdata->output_name);
+  result = VERIFY_ERROR;
+ }
+ return result;
+} /* verify_readback */
 
- /* Setting status. */
- fdata->status = TS_DONE;
- /* Result OK. */
- fdata->result = EXIT_OK;
+/* Copy only the data extents of the task's range, the holes are left
+   unwritten so the output gets them too. Each extent is copied by the
+   regular engines as a range of its own. */
+int copy_sparse(copytask *task, int infd, int outfd)
+{
+ filedata *fdata = task->fdata;
+ int whole = task->length == COPY_TO_EOF;
+ unsigned long int pos = task->offset, start, len;
+ unsigned long int end = whole ? fdata->size : task->offset + task->length;
+ copytask extent;
+ int result = EXIT_OK;
 
- /* End timing thread. */
- gettimeofday(&t2, NULL);
- fdata->time_usec = (double) (t2.tv_usec - t1.tv_usec) / 1000000;
- fdata->time_sec = (double) (t2.tv_sec - t1.tv_sec);
-} /* copyFile */ 
+ task->engine = engine;
+ while (pos < end && result == EXIT_OK)
+ {
+  start = pos;
+  len = data_extent(infd, &pos, end);
+  if (pos > start)
+   result = sparse_hole(task, outfd, start, pos - start);
+  if (len == 0 || result != EXIT_OK)
+   break;
+  if (lseek(infd, (off_t)pos, SEEK_SET) < 0 ||
+      lseek(outfd, (off_t)pos, SEEK_SET) < 0)
+  {
+   fprintf(stderr, "Error while seeking in file: %s -> %s\n",
+           fdata->input_name, fdata->output_name);
+   return READ_ERROR;
+  }
+  extent = *task;
+  extent.offset = pos;
+  extent.length = len;
+  result = copy_engine(&extent, infd, outfd);
+  task->engine = extent.engine;
+  pos += len;
+ }
+ /* A trailing hole only exists once the size is set. */
+ if (result == EXIT_OK && whole && ftruncate(outfd, (off_t)end) != 0)
+ {
+  fprintf(stderr, "Error while truncating output file: %s\n",
+          fdata->output_name);
+  result = WRITE_ERROR;
+ }
+ return result;
+} /* copy_sparse */
 
-unsigned int get_filenames(char *farg, char fn[FILES_MAX][PATH_MAX])
+/* Account for a hole in the input. Fresh outputs already read as zeros
+   there, an existing delta output gets the range punched out or, where
+   that is not supported, zeroed. */
+int sparse_hole(copytask *task, int outfd, unsigned long int offset,
+                unsigned long int len)
 {
- char *tstr, *saveptr, *token;
- int i;
- int numf = 0;
- if (strlen(farg) > 0)
+ filedata *fdata = task->fdata;
+ unsigned char *zeros = task->worker->obuffer;
+ unsigned long int done;
+ size_t n;
+
+ if (fdata->verify == VERIFY_SINGLE)
+  hash_zeros(&task->worker->vhash, zeros, len);
+ if (engine == ENGINE_DELTA &&
+     fallocate(outfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+               (off_t)offset, (off_t)len) != 0)
  {
-   if (strstr(farg, DELIMITER) == NULL)
+  memset(zeros, 0, blocksize);
+  if (lseek(outfd, (off_t)offset, SEEK_SET) < 0)
+   return WRITE_ERROR;
+  for (done = 0; done < len; done += n)
+  {
+   n = len - done < blocksize ? (size_t)(len - done) : blocksize;
+   if (write_all(outfd, zeros, n, latency_hist(task, LAT_WRITE)) != 0)
    {
-    strncpy(fn[0], farg, PATH_MAX);
-    return 1;
+    fprintf(stderr, "Error while writing output file: %s\n",
+            fdata->output_name);
+    return WRITE_ERROR;
    }
+  }
+ }
+ progress_add(task, len);
+ return EXIT_OK;
+} /* sparse_hole */
+
+/* Move *pos to the next data at or after it below end and return how
+   much data follows there, 0 when only holes are left. Filesystems
+   without SEEK_DATA report everything as data. The file offset is put
+   back where it was. */
+unsigned long int data_extent(int fd, unsigned long int *pos,
+                              unsigned long int end)
+{
+ off_t data, hole;
+ off_t current = lseek(fd, 0, SEEK_CUR);
+ unsigned long int len = 0;
+
+ if (*pos >= end)
+  return 0;
+ if ((data = lseek(fd, (off_t)*pos, SEEK_DATA)) < 0)
+ {
+  if (errno != ENXIO)
+   len = end - *pos;
+  else
+   *pos = end;
+ }
+ else if ((unsigned long int)data >= end)
+ {
+  *pos = end;
  }
  else
  {
-  return 0;
+  if ((hole = lseek(fd, data, SEEK_HOLE)) < 0 ||
+      (unsigned long int)hole > end)
+   hole = (off_t)end;
+  *pos = (unsigned long int)data;
+  len = (unsigned long int)(hole - data);
  }
- for (i = 0, tstr = farg; i < FILES_MAX; i++, tstr = NULL)
+ lseek(fd, current, SEEK_SET);
+ return len;
+} /* data_extent */
+
+/* Digest len zero bytes, as a hole reads, using buf as scratch. */
+void hash_zeros(hashstate *state, unsigned char *buf, unsigned long int len)
+{
+ size_t n = len < blocksize ? (size_t)len : blocksize;
+
+ memset(buf, 0, n);
+ for (; len > 0; len -= n)
  {
-  token = strtok_r(tstr, DELIMITER, &saveptr);
-  if (token == NULL)
+  n = len < blocksize ? (size_t)len : blocksize;
+  hash_update(state, buf, n);
+ }
+} /* hash_zeros */
+
+int copy_engine(copytask *task, int infd, int outfd)
+{
+ filedata *fdata = task->fdata;
+ int e, result;
+ int allocated = 0;
+
+ if (engine != ENGINE_AUTO)
+ {
+  task->engine = engine;
+  if (engine != ENGINE_REFLINK && (result = preallocate(task, outfd)) != 0)
+   return result;
+  result = engines[engine].copy(task, infd, outfd);
+  if (result == ENGINE_UNSUPPORTED)
   {
-   numf = i;
+   fprintf(stderr, "Copy engine %s not supported for: %s -> %s\n",
+           engines[engine].name, fdata->input_name, fdata->output_name);
+   result = WRITE_ERROR;
+  }
+  return result;
+ }
+
+ /* Probe engines in order, falling back until one takes the file pair.
+    Extents are only worth reserving once cloning is ruled out. */
+ for (e = 0; ; e++)
+ {
+  task->engine = engines_auto[e];
+  if (task->engine != ENGINE_REFLINK && !allocated)
+  {
+   allocated = 1;
+   if ((result = preallocate(task, outfd)) != 0)
+    return result;
+  }
+  result = engines[task->engine].copy(task, infd, outfd);
+  if (result != ENGINE_UNSUPPORTED)
+   return result;
+  DPRINT("Copy engine %s not supported, falling back: %s\n",
+         engines[task->engine].name, fdata->output_name);
+ }
+} /* copy_engine */
+
+/* Userspace engines copy task->length bytes, or up to end of file for a
+   whole file, from the current offsets of infd and outfd. */
+int engine_stdio(copytask *task, int infd, int outfd)
+{
+ filedata *fdata = task->fdata;
+ unsigned long int left = task->length;
+ int result;
+
+ /* Pipelining only pays off when there is more than one block. */
+ if (pipeline && fdata->size > blocksize && left > blocksize)
+ {
+  result = copy_pipelined(task, infd, outfd);
+  if (result != ENGINE_UNSUPPORTED)
+   return result;
+ }
+ return copy_buffered(task, infd, outfd);
+} /* engine_stdio */
+
+/* Copy block by block through the worker buffer, also the tail after
+   the engines that copy up to the size taken by the probe. */
+int copy_buffered(copytask *task, int infd, int outfd)
+{
+ filedata *fdata = task->fdata;
+ unsigned char *buffer = task->worker->ibuffer;
+ unsigned long int left = task->length;
+ ssize_t bytes_read;
+
+ while (left > 0)
+ {
+  bytes_read = read_full(infd, buffer, left < blocksize ?
+                         (size_t)left : blocksize,
+                         latency_hist(task, LAT_READ));
+  if (bytes_read == 0)
    break;
+  if (bytes_read < 0)
+  {
+   fprintf(stderr, "Error while reading input file: %s\n", fdata->input_name);
+   return READ_ERROR;
+  }
+  if (fdata->verify == VERIFY_SINGLE)
+   hash_update(&task->worker->vhash, buffer, (size_t)bytes_read);
+  if (write_all(outfd, buffer, (size_t)bytes_read,
+                latency_hist(task, LAT_WRITE)) != 0)
+  {
+   fprintf(stderr, "Error while writing output file: %s\n",
+           fdata->output_name);
+   return WRITE_ERROR;
   }
-  strncpy(fn[i], token, PATH_MAX);
+  progress_add(task, (unsigned long int)bytes_read);
+  sync_written(task, (unsigned long int)bytes_read);
+  if (left != COPY_TO_EOF)
+   left -= (unsigned long int)bytes_read;
  }
- if (numf > 0)
-  numf -= 1;
- return numf;
-}
+ return EXIT_OK;
+} /* copy_buffered */
 
-unsigned long int check_file_size(FILE *fp)
+/* Read the input once and write each block to the first output and the
+   replicas. An output that fails is dropped and the others go on, the
+   first one is -1 when it could not be opened. Returns the result of the
+   first output, a read error ends the copy for all. */
+int copy_fanout(copytask *task, int infd, int outfd)
 {
- unsigned long int fsize;
- fseek(fp, 0L, SEEK_END);
- fsize = ftell(fp);
- fseek(fp, 0L, SEEK_SET);
- return fsize;
-}
+ filedata *fdata = task->fdata;
+ unsigned char *buffer = task->worker->ibuffer;
+ unsigned long int left = task->length;
+ ssize_t bytes_read;
+ int result = outfd >= 0 ? preallocate(task, outfd) : WRITE_ERROR;
+ int k, live;
+
+ while (left > 0)
+ {
+  for (k = 0, live = result == EXIT_OK; k < fdata->replicas; k++)
+   live |= task->outfds[k] >= 0;
+  if (!live)
+   break;
+  bytes_read = read_full(infd, buffer, left < blocksize ?
+                         (size_t)left : blocksize,
+                         latency_hist(task, LAT_READ));
+  if (bytes_read == 0)
+   break;
+  if (bytes_read < 0)
+  {
+   fprintf(stderr, "Error while reading input file: %s\n", fdata->input_name);
+   return READ_ERROR;
+  }
+  if (fdata->verify == VERIFY_SINGLE)
+   hash_update(&task->worker->vhash, buffer, (size_t)bytes_read);
+  if (result == EXIT_OK &&
+      write_all(outfd, buffer, (size_t)bytes_read,
+                latency_hist(task, LAT_WRITE)) != 0)
+  {
+   task_failed(task, PHASE_WRITE);
+   fprintf(stderr, "Error while writing output file: %s\n",
+           fdata->output_name);
+   result = WRITE_ERROR;
+  }
+  fanout_write(task, buffer, (size_t)bytes_read);
+  progress_add(task, (unsigned long int)bytes_read);
+  sync_written(task, (unsigned long int)bytes_read);
+  if (left != COPY_TO_EOF)
+   left -= (unsigned long int)bytes_read;
+ }
+ return result;
+} /* copy_fanout */
+
+/* Reader stage runs in the worker thread while its writer thread drains
+   the ring, so source and destination devices work at the same time. */
+int copy_pipelined(copytask *task, int infd, int outfd)
+{
+ filedata *fdata = task->fdata;
+ workerdata *wdata = task->worker;
+ unsigned long int left = task->length;
+ pipering *ring;
+ unsigned char *buffer;
+ ssize_t bytes_read;
+ int result = EXIT_OK;
+
+ if (wdata->pipe == NULL && (wdata->pipe = pipe_start(wdata)) == NULL)
+ {
+  DPRINT("Error creating pipeline writer, copying unpipelined: %s\n",
+         fdata->output_name);
+  return ENGINE_UNSUPPORTED;
+ }
+ ring = wdata->pipe;
+ pthread_mutex_lock(&ring->lock);
+ ring->task = task;
+ ring->outfd = outfd;
+ ring->head = ring->tail = ring->count = 0;
+ ring->result = EXIT_OK;
+ pthread_mutex_unlock(&ring->lock);
+
+ for (;;)
+ {
+  /* Wait for a free slot. */
+  pthread_mutex_lock(&ring->lock);
+  while (ring->count == ring->depth && ring->result == EXIT_OK)
+   pthread_cond_wait(&ring->not_full, &ring->lock);
+  if (ring->result != EXIT_OK)
+  {
+   pthread_mutex_unlock(&ring->lock);
+   break;
+  }
+  buffer = ring->buffers + (size_t)ring->head * blocksize;
+  pthread_mutex_unlock(&ring->lock);
+
+  /* Slot at head is only touched by the reader until it is published. */
+  bytes_read = 0;
+  if (left > 0)
+   bytes_read = read_full(infd, buffer, left < blocksize ?
+                          (size_t)left : blocksize,
+                          latency_hist(task, LAT_READ));
+  if (bytes_read < 0)
+  {
+   fprintf(stderr, "Error while reading input file: %s\n", fdata->input_name);
+   result = READ_ERROR;
+  }
+  else if (fdata->verify == VERIFY_SINGLE)
+  {
+   hash_update(&wdata->vhash, buffer, (size_t)bytes_read);
+  }
+  if (bytes_read <= 0)
+   break;
+  if (left != COPY_TO_EOF)
+   left -= (unsigned long int)bytes_read;
+
+  pthread_mutex_lock(&ring->lock);
+  ring->lengths[ring->head] = (size_t)bytes_read;
+  ring->head = (ring->head + 1) % ring->depth;
+  ring->count++;
+  pthread_cond_signal(&ring->not_empty);
+  pthread_mutex_unlock(&ring->lock);
+ }
+
+ /* The writer drains the ring, or drops what is left after an error,
+    before the next file may use it. */
+ pthread_mutex_lock(&ring->lock);
+ ring->eof = 1;
+ pthread_cond_signal(&ring->not_empty);
+ while (ring->eof)
+  pthread_cond_wait(&ring->not_full, &ring->lock);
+ if (result == EXIT_OK && (result = ring->result) != EXIT_OK)
+  errno = ring->err;
+ ring->task = NULL;
+ pthread_mutex_unlock(&ring->lock);
+ return result;
+} /* copy_pipelined */
+
+/* Set up the pipeline ring of a worker over its ring buffers and start
+   the writer thread, it inherits the placement of the worker. */
+pipering *pipe_start(workerdata *wdata)
+{
+ pipering *ring;
+
+ if ((ring = calloc(1, sizeof *ring)) == NULL)
+  return NULL;
+ ring->buffers = wdata->ring;
+ ring->depth = ring_depth;
+ ring->result = EXIT_OK;
+ pthread_mutex_init(&ring->lock, NULL);
+ pthread_cond_init(&ring->not_empty, NULL);
+ pthread_cond_init(&ring->not_full, NULL);
+ if (pthread_create(&ring->writer, NULL, pipeWriter, ring) != 0)
+ {
+  pthread_cond_destroy(&ring->not_full);
+  pthread_cond_destroy(&ring->not_empty);
+  pthread_mutex_destroy(&ring->lock);
+  free(ring);
+  return NULL;
+ }
+ return ring;
+} /* pipe_start */
+
+void pipe_stop(pipering *ring)
+{
+ pthread_mutex_lock(&ring->lock);
+ ring->quit = 1;
+ pthread_cond_signal(&ring->not_empty);
+ pthread_mutex_unlock(&ring->lock);
+ pthread_join(ring->writer, NULL);
+ pthread_cond_destroy(&ring->not_full);
+ pthread_cond_destroy(&ring->not_empty);
+ pthread_mutex_destroy(&ring->lock);
+ free(ring);
+} /* pipe_stop */
+
+void *pipeWriter(void *arg)
+{
+ pipering *ring = (pipering *)arg;
+ unsigned char *buffer;
+ size_t length;
+ int result;
+
+ pthread_mutex_lock(&ring->lock);
+ for (;;)
+ {
+  while (ring->count == 0 && !ring->eof && !ring->quit)
+   pthread_cond_wait(&ring->not_empty, &ring->lock);
+  if (ring->quit)
+   break;
+  if (ring->count == 0)
+  {
+   /* The file is drained, the ring goes back to the reader. */
+   ring->eof = 0;
+   pthread_cond_signal(&ring->not_full);
+   continue;
+  }
+  buffer = ring->buffers + (size_t)ring->tail * blocksize;
+  length = ring->lengths[ring->tail];
+  result = ring->result;
+  pthread_mutex_unlock(&ring->lock);
+
+  /* Slot at tail is only touched by the writer until it is released,
+     after an error the rest of the file is dropped. */
+  if (result == EXIT_OK &&
+      write_all(ring->outfd, buffer, length,
+                latency_hist(ring->task, LAT_WRITE)) != 0)
+  {
+   ring->err = errno;
+   fprintf(stderr, "Error while writing output file: %s\n",
+           ring->task->fdata->output_name);
+   result = WRITE_ERROR;
+  }
+  else if (result == EXIT_OK)
+  {
+   progress_add(ring->task, (unsigned long int)length);
+   sync_written(ring->task, (unsigned long int)length);
+  }
+
+  pthread_mutex_lock(&ring->lock);
+  ring->tail = (ring->tail + 1) % ring->depth;
+  ring->count--;
+  ring->result = result;
+  pthread_cond_signal(&ring->not_full);
+ }
+ pthread_mutex_unlock(&ring->lock);
+ return NULL;
+} /* pipeWriter */
+
+int engine_cfr(copytask *task, int infd, int outfd)
+{
+ filedata *fdata = task->fdata;
+ unsigned long int left = task->length;
+ ssize_t copied;
+ unsigned long int total = 0;
+ size_t max, len;
+ uint64_t start;
+
+ while (left > 0)
+ {
+  /* Small calls keep a throttled kernel copy from bursting. */
+  max = bw_limit.rate || iops_limit.rate ? blocksize : KCOPY_MAX;
+  len = left < max ? (size_t)left : max;
+  throttle_io(len, 2);
+  start = stats ? monotonic_ns() : 0;
+  copied = copy_file_range(infd, NULL, outfd, NULL, len, 0);
+  if (stats)
+   latency_add(latency_hist(task, LAT_COPY), start);
+  if (copied == 0)
+   break;
+  if (copied < 0)
+  {
+   if (errno == EINTR)
+    continue;
+   if (total == 0 && kcopy_unsupported(errno, infd, task->offset))
+    return ENGINE_UNSUPPORTED;
+   fprintf(stderr, "Error while copying file: %s -> %s\n",
+           fdata->input_name, fdata->output_name);
+   return kcopy_error(errno);
+  }
+  total += (unsigned long int)copied;
+  progress_add(task, (unsigned long int)copied);
+  sync_written(task, (unsigned long int)copied);
+  if (left != COPY_TO_EOF)
+   left -= (unsigned long int)copied;
+ }
+ return EXIT_OK;
+} /* engine_cfr */
+
+int engine_sendfile(copytask *task, int infd, int outfd)
+{
+ filedata *fdata = task->fdata;
+ unsigned long int left = task->length;
+ ssize_t copied;
+ unsigned long int total = 0;
+ size_t max, len;
+ uint64_t start;
+
+ while (left > 0)
+ {
+  /* Small calls keep a throttled kernel copy from bursting. */
+  max = bw_limit.rate || iops_limit.rate ? blocksize : KCOPY_MAX;
+  len = left < max ? (size_t)left : max;
+  throttle_io(len, 2);
+  start = stats ? monotonic_ns() : 0;
+  copied = sendfile(outfd, infd, NULL, len);
+  if (stats)
+   latency_add(latency_hist(task, LAT_COPY), start);
+  if (copied == 0)
+   break;
+  if (copied < 0)
+  {
+   if (errno == EINTR)
+    continue;
+   if (total == 0 && kcopy_unsupported(errno, infd, task->offset))
+    return ENGINE_UNSUPPORTED;
+   fprintf(stderr, "Error while copying file: %s -> %s\n",
+           fdata->input_name, fdata->output_name);
+   return kcopy_error(errno);
+  }
+  total += (unsigned long int)copied;
+  progress_add(task, (unsigned long int)copied);
+  sync_written(task, (unsigned long int)copied);
+  if (left != COPY_TO_EOF)
+   left -= (unsigned long int)copied;
+ }
+ return EXIT_OK;
+} /* engine_sendfile */
+
+int engine_reflink(copytask *task, int infd, int outfd)
+{
+ filedata *fdata = task->fdata;
+ clonerange range;
+ int ret;
+
+ if (task->length == COPY_TO_EOF)
+ {
+  ret = ioctl(outfd, FICLONE, infd);
+ }
+ else
+ {
+  /* Cloning the last chunk up to end of file is allowed unaligned. */
+  range.src_fd = infd;
+  range.src_offset = task->offset;
+  range.src_length = task->offset + task->length >= fdata->size ?
+                     0 : task->length;
+  range.dest_offset = task->offset;
+  ret = ioctl(outfd, FICLONERANGE_TC, &range);
+ }
+ if (ret != 0)
+ {
+  if (kcopy_unsupported(errno, infd, task->length == COPY_TO_EOF ? 0 :
+                        task->offset + range.src_length))
+   return ENGINE_UNSUPPORTED;
+  fprintf(stderr, "Error while cloning file: %s -> %s\n",
+          fdata->input_name, fdata->output_name);
+  return kcopy_error(errno);
+ }
+ progress_add(task, task->length == COPY_TO_EOF ? fdata->size : task->length);
+ return EXIT_OK;
+} /* engine_reflink */
+
+int engine_uring(copytask *task, int infd, int outfd)
+{
+#ifdef HAVE_IO_URING
+ filedata *fdata = task->fdata;
+ workerdata *wdata = task->worker;
+ int whole = task->length == COPY_TO_EOF;
+ copytask rest;
+ int result;
+
+ if (wdata->uring == NULL && (wdata->uring = uring_setup(wdata)) == NULL)
+  return ENGINE_UNSUPPORTED;
+ result = uring_copy(task, wdata->uring, infd, outfd,
+                     whole ? fdata->size : task->offset + task->length);
+ if (wdata->uring->broken)
+ {
+  /* Closing the ring cancels what is left, later files go without. */
+  uring_free(wdata->uring);
+  wdata->uring = NULL;
+ }
+ if (result != EXIT_OK || !whole)
+  return result;
+
+ /* Pick up anything appended since the size was taken. */
+ if (lseek(infd, (off_t)fdata->size, SEEK_SET) < 0 ||
+     lseek(outfd, (off_t)fdata->size, SEEK_SET) < 0)
+ {
+  fprintf(stderr, "Error while seeking in file: %s -> %s\n",
+          fdata->input_name, fdata->output_name);
+  return READ_ERROR;
+ }
+ rest = *task;
+ rest.offset = fdata->size;
+ return copy_buffered(&rest, infd, outfd);
+#else
+ (void)task;
+ (void)infd;
+ (void)outfd;
+ return ENGINE_UNSUPPORTED;
+#endif
+} /* engine_uring */
+
+/* Read the existing output alongside the input and write back only the
+   blocks that differ, the output ends up the size of the input. */
+int engine_delta(copytask *task, int infd, int outfd)
+{
+ filedata *fdata = task->fdata;
+ unsigned char *ibuffer = task->worker->ibuffer;
+ unsigned char *obuffer = task->worker->obuffer;
+ unsigned long int offset = task->offset;
+ unsigned long int left = task->length;
+ unsigned long int changed = 0;
+ ssize_t bytes_read, out_read;
+
+ while (left > 0)
+ {
+  bytes_read = read_full(infd, ibuffer, left < blocksize ?
+                         (size_t)left : blocksize,
+                         latency_hist(task, LAT_READ));
+  if (bytes_read == 0)
+   break;
+  if (bytes_read < 0)
+  {
+   fprintf(stderr, "Error while reading input file: %s\n", fdata->input_name);
+   return READ_ERROR;
+  }
+  if (fdata->verify == VERIFY_SINGLE)
+   hash_update(&task->worker->vhash, ibuffer, (size_t)bytes_read);
+  if ((out_read = read_full(outfd, obuffer, (size_t)bytes_read,
+                            latency_hist(task, LAT_READ))) < 0)
+  {
+   fprintf(stderr, "Error while reading output file: %s\n",
+           fdata->output_name);
+   return READ_ERROR;
+  }
+  /* Short output reads are past its end, that part is always written. */
+  if (out_read != bytes_read ||
+      compare_block(ibuffer, obuffer, (size_t)bytes_read) <
+      (size_t)bytes_read)
+  {
+   if (lseek(outfd, (off_t)offset, SEEK_SET) < 0 ||
+       write_all(outfd, ibuffer, (size_t)bytes_read,
+                 latency_hist(task, LAT_WRITE)) != 0)
+   {
+    fprintf(stderr, "Error while writing output file: %s\n",
+            fdata->output_name);
+    return WRITE_ERROR;
+   }
+   changed += (unsigned long int)bytes_read;
+  }
+  progress_add(task, (unsigned long int)bytes_read);
+  sync_written(task, (unsigned long int)bytes_read);
+  offset += (unsigned long int)bytes_read;
+  if (left != COPY_TO_EOF)
+   left -= (unsigned long int)bytes_read;
+ }
+ /* Drop whatever an older, longer output had past the input. */
+ if (task->length == COPY_TO_EOF && ftruncate(outfd, (off_t)offset) != 0)
+ {
+  fprintf(stderr, "Error while truncating output file: %s\n",
+          fdata->output_name);
+  return WRITE_ERROR;
+ }
+ DPRINT("Delta rewrote %lu of %lu byte(s) at offset %lu: %s\n", changed,
+        offset - task->offset, task->offset, fdata->output_name);
+ return EXIT_OK;
+} /* engine_delta */
+
+/* Write from a shared read-only mapping of the input in MMAP_WINDOW
+   pieces. A fault on the mapping, the input shrinking or failing under
+   us, is caught as SIGBUS and reported as a read error. */
+int engine_mmap(copytask *task, int infd, int outfd)
+{
+ filedata *fdata = task->fdata;
+ int whole = task->length == COPY_TO_EOF;
+ unsigned long int end = whole ? fdata->size : task->offset + task->length;
+ unsigned long int base;
+ volatile unsigned long int pos = task->offset;
+ size_t page = (size_t)sysconf(_SC_PAGESIZE);
+ unsigned char *volatile map = NULL;
+ volatile size_t maplen = 0;
+ size_t done, len;
+ sigjmp_buf jump;
+ copytask rest;
+
+ while (pos < end)
+ {
+  base = pos - pos % page;
+  maplen = end - base < MMAP_WINDOW ? (size_t)(end - base) : MMAP_WINDOW;
+  if ((map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, infd,
+                  (off_t)base)) == MAP_FAILED)
+  {
+   if (pos == task->offset)
+    return ENGINE_UNSUPPORTED;
+   fprintf(stderr, "Error while mapping input file: %s\n",
+           fdata->input_name);
+   return READ_ERROR;
+  }
+  madvise(map, maplen, MADV_SEQUENTIAL);
+  if (sigsetjmp(jump, 1) != 0)
+  {
+   mmap_jump = NULL;
+   munmap(map, maplen);
+   fprintf(stderr, "Error while reading mapped input file: %s\n",
+           fdata->input_name);
+   return READ_ERROR;
+  }
+  mmap_jump = &jump;
+  for (done = pos - base; done < maplen; done += len)
+  {
+   len = maplen - done < blocksize ? maplen - done : blocksize;
+   /* The write is throttled in write_all. */
+   throttle_io(len, 1);
+   if (fdata->verify == VERIFY_SINGLE)
+    hash_update(&task->worker->vhash, map + done, len);
+   if (write_all(outfd, map + done, len, latency_hist(task, LAT_WRITE)) != 0)
+   {
+    /* The kernel reports a fault on the source buffer as EFAULT. */
+    mmap_jump = NULL;
+    munmap(map, maplen);
+    if (errno == EFAULT)
+     fprintf(stderr, "Error while reading mapped input file: %s\n",
+             fdata->input_name);
+    else
+     fprintf(stderr, "Error while writing output file: %s\n",
+             fdata->output_name);
+    return errno == EFAULT ? READ_ERROR : WRITE_ERROR;
+   }
+   progress_add(task, (unsigned long int)len);
+   sync_written(task, (unsigned long int)len);
+  }
+  mmap_jump = NULL;
+  munmap(map, maplen);
+  pos = base + maplen;
+ }
+ if (!whole)
+  return EXIT_OK;
+
+ /* Pick up anything appended since the size was taken. */
+ if (lseek(infd, (off_t)fdata->size, SEEK_SET) < 0 ||
+     lseek(outfd, (off_t)fdata->size, SEEK_SET) < 0)
+ {
+  fprintf(stderr, "Error while seeking in file: %s -> %s\n",
+          fdata->input_name, fdata->output_name);
+  return READ_ERROR;
+ }
+ rest = *task;
+ rest.offset = fdata->size;
+ return copy_buffered(&rest, infd, outfd);
+} /* engine_mmap */
+
+/* Route SIGBUS on a mapping back to the worker that touched it. */
+void mmap_fault(int sig)
+{
+ if (mmap_jump != NULL)
+  siglongjmp(*mmap_jump, 1);
+ signal(sig, SIG_DFL);
+ raise(sig);
+} /* mmap_fault */
+
+#ifdef HAVE_IO_URING
+uring *uring_setup(workerdata *wdata)
+{
+ struct io_uring_params params;
+ struct iovec iov[PIPELINE_MAX];
+ int files[2] = { -1, -1 };
+ uring *ring;
+ unsigned char *sq;
+ unsigned char *cq;
+ int i;
+
+ if ((ring = calloc(1, sizeof *ring)) == NULL)
+  return NULL;
+ memset(&params, 0, sizeof params);
+ /* Each slot has a read and a write in flight. */
+ ring->entries = (unsigned int)ring_depth * 2;
+ ring->fd = (int)syscall(__NR_io_uring_setup, ring->entries, &params);
+ if (ring->fd < 0)
+ {
+  DPRINT("io_uring not available for worker [%04d]\n", wdata->id);
+  free(ring);
+  return NULL;
+ }
+
+ ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+ ring->cq_len = params.cq_off.cqes +
+                params.cq_entries * sizeof(struct io_uring_cqe);
+ if (params.features & IORING_FEAT_SINGLE_MMAP)
+ {
+  if (ring->cq_len > ring->sq_len)
+   ring->sq_len = ring->cq_len;
+  ring->cq_len = ring->sq_len;
+ }
+ ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+ if (ring->sq_ptr == MAP_FAILED)
+ {
+  close(ring->fd);
+  free(ring);
+  return NULL;
+ }
+ if (params.features & IORING_FEAT_SINGLE_MMAP)
+ {
+  ring->cq_ptr = ring->sq_ptr;
+ }
+ else
+ {
+  ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  if (ring->cq_ptr == MAP_FAILED)
+  {
+   munmap(ring->sq_ptr, ring->sq_len);
+   close(ring->fd);
+   free(ring);
+   return NULL;
+  }
+ }
+ ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+ ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+ if (ring->sqes == MAP_FAILED)
+ {
+  ring->sqes = NULL;
+  uring_free(ring);
+  return NULL;
+ }
+
+ sq = ring->sq_ptr;
+ cq = ring->cq_ptr;
+ ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+ ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+ ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+ ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+ ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+ ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+ ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+ ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+ /* Register the worker ring buffers, then reuse them for every file. */
+ for (i = 0; i < ring_depth; i++)
+ {
+  iov[i].iov_base = wdata->ring + (size_t)i * blocksize;
+  iov[i].iov_len = blocksize;
+ }
+ if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+             iov, ring_depth) != 0)
+ {
+  DPRINT("io_uring buffer registration failed for worker [%04d]\n",
+         wdata->id);
+  uring_free(ring);
+  return NULL;
+ }
+ /* Fixed files are optional, older kernels can't register empty slots. */
+ ring->fixed_files = syscall(__NR_io_uring_register, ring->fd,
+                             IORING_REGISTER_FILES, files, 2) == 0;
+ DPRINT("io_uring set up for worker [%04d] with %u entries%s\n", wdata->id,
+        ring->entries, ring->fixed_files ? " and fixed files" : "");
+ return ring;
+} /* uring_setup */
+
+void uring_free(uring *ring)
+{
+ if (ring->sqes)
+  munmap(ring->sqes, ring->sqes_len);
+ if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+  munmap(ring->cq_ptr, ring->cq_len);
+ munmap(ring->sq_ptr, ring->sq_len);
+ close(ring->fd);
+ free(ring);
+} /* uring_free */
+
+/* Point the two fixed file slots at a file pair, -1 clears them. */
+int uring_files(uring *ring, int infd, int outfd)
+{
+ struct io_uring_files_update update;
+ int files[2];
+
+ files[0] = infd;
+ files[1] = outfd;
+ memset(&update, 0, sizeof update);
+ update.fds = (unsigned long int)files;
+ return syscall(__NR_io_uring_register, ring->fd,
+                IORING_REGISTER_FILES_UPDATE, &update, 2) == 2 ? 0 : -1;
+} /* uring_files */
+
+void uring_push(uring *ring, int op, int fd, unsigned char *buf, size_t len,
+                unsigned long int offset, int flags, int index,
+                unsigned long int data)
+{
+ unsigned int tail = *ring->sq_tail;
+ unsigned int sqi = tail & *ring->sq_mask;
+ struct io_uring_sqe *sqe = &ring->sqes[sqi];
+
+ memset(sqe, 0, sizeof *sqe);
+ sqe->opcode = (unsigned char)op;
+ sqe->flags = (unsigned char)flags;
+ sqe->fd = fd;
+ sqe->addr = (unsigned long int)buf;
+ sqe->len = (unsigned int)len;
+ sqe->off = offset;
+ sqe->buf_index = (unsigned short)index;
+ sqe->user_data = data;
+ ring->sq_array[sqi] = sqi;
+ __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+} /* uring_push */
+
+/* Copy from task->offset up to end keeping ring_depth read/write pairs in
+   flight. Reads are linked to the write of the same buffer, a short read
+   breaks the link and the tail is written by hand. */
+int uring_copy(copytask *task, uring *ring, int infd, int outfd,
+               unsigned long int end)
+{
+ filedata *fdata = task->fdata;
+ unsigned char *buffers = task->worker->ring;
+ uringslot slots[PIPELINE_MAX];
+ int free_slots[PIPELINE_MAX];
+ int nfree = ring_depth;
+ unsigned long int next = task->offset;
+ unsigned long int hash_next = task->offset;
+ unsigned int submit = 0;
+ unsigned int head, tail;
+ struct io_uring_cqe *cqe;
+ int inflight = 0;
+ int result = EXIT_OK;
+ int stop = 0;
+ int rfd = infd, wfd = outfd, fflags = 0;
+ int slot, res, s;
+ unsigned char *buf;
+ long ret;
+
+ if (ring->fixed_files && uring_files(ring, infd, outfd) == 0)
+ {
+  rfd = 0;
+  wfd = 1;
+  fflags = IOSQE_FIXED_FILE;
+ }
+ memset(slots, 0, sizeof slots);
+ for (slot = 0; slot < ring_depth; slot++)
+  free_slots[slot] = ring_depth - 1 - slot;
+
+ while (inflight > 0 || (!stop && next < end))
+ {
+  /* Fill free slots with linked read and write pairs. */
+  while (!stop && nfree > 0 && next < end)
+  {
+   slot = free_slots[--nfree];
+   buf = buffers + (size_t)slot * blocksize;
+   slots[slot].offset = next;
+   slots[slot].length = end - next < blocksize ?
+                        (size_t)(end - next) : blocksize;
+   slots[slot].read_res = 0;
+   slots[slot].write_res = -ECANCELED;
+   slots[slot].copied = 0;
+   slots[slot].hashed = 0;
+   next += slots[slot].length;
+   throttle_io(slots[slot].length, 2);
+   if (stats)
+    slots[slot].submitted = monotonic_ns();
+   if (direct && slots[slot].length % DIRECT_ALIGN != 0)
+   {
+    /* O_DIRECT tail, read aligned and write it by hand when it lands. */
+    slots[slot].pending = 1;
+    uring_push(ring, IORING_OP_READ_FIXED, rfd, buf,
+               (slots[slot].length + DIRECT_ALIGN - 1) / DIRECT_ALIGN *
+               DIRECT_ALIGN, slots[slot].offset, fflags, slot,
+               (unsigned long int)slot << 1);
+    submit += 1;
+    inflight += 1;
+    continue;
+   }
+   slots[slot].pending = 2;
+   uring_push(ring, IORING_OP_READ_FIXED, rfd, buf, slots[slot].length,
+              slots[slot].offset, fflags | IOSQE_IO_LINK, slot,
+              (unsigned long int)slot << 1);
+   uring_push(ring, IORING_OP_WRITE_FIXED, wfd, buf, slots[slot].length,
+              slots[slot].offset, fflags, slot,
+              ((unsigned long int)slot << 1) | 1);
+   submit += 2;
+   inflight += 2;
+  }
+
+  /* Submit and wait for at least one completion. */
+  ret = syscall(__NR_io_uring_enter, ring->fd, submit, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+  if (ret < 0)
+  {
+   if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+    continue;
+   fprintf(stderr, "Error while submitting io_uring requests: %s -> %s\n",
+           fdata->input_name, fdata->output_name);
+   result = READ_ERROR;
+   /* Requests in flight point into the worker buffers, none may be
+      left for the next file to reap as its own. */
+   if (uring_drain(ring, inflight) != 0)
+    ring->broken = 1;
+   break;
+  }
+  submit -= (unsigned int)ret;
+
+  /* Reap completions. */
+  head = *ring->cq_head;
+  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail)
+  {
+   cqe = &ring->cqes[head & *ring->cq_mask];
+   slot = (int)(cqe->user_data >> 1);
+   if (cqe->user_data & 1)
+    slots[slot].write_res = cqe->res;
+   else
+    slots[slot].read_res = cqe->res;
+   if (stats)
+    latency_add(latency_hist(task, cqe->user_data & 1 ? LAT_WRITE : LAT_READ),
+                slots[slot].submitted);
+   head++;
+   inflight--;
+   if (--slots[slot].pending > 0)
+    continue;
+   buf = buffers + (size_t)slot * blocksize;
+   res = uring_finish(&slots[slot], buf, outfd, &stop);
+   progress_add(task, (unsigned long int)slots[slot].copied);
+   sync_written(task, (unsigned long int)slots[slot].copied);
+   if (res != EXIT_OK && result == EXIT_OK)
+   {
+    if (res == READ_ERROR)
+     fprintf(stderr, "Error while reading input file: %s\n",
+             fdata->input_name);
+    else
+     fprintf(stderr, "Error while writing output file: %s\n",
+             fdata->output_name);
+    result = res;
+    stop = 1;
+   }
+   if (fdata->verify != VERIFY_SINGLE)
+   {
+    free_slots[nfree++] = slot;
+    continue;
+   }
+   /* Digest finished slots in offset order, then release them. */
+   slots[slot].hashed = 1;
+   for (s = 0; s < ring_depth; s++)
+   {
+    if (!slots[s].hashed || slots[s].offset != hash_next)
+     continue;
+    hash_update(&task->worker->vhash, buffers + (size_t)s * blocksize,
+                slots[s].copied);
+    hash_next += slots[s].copied;
+    slots[s].hashed = 0;
+    free_slots[nfree++] = s;
+    s = -1;
+   }
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+ }
+
+ if (fflags && !ring->broken)
+  uring_files(ring, -1, -1);
+ return result;
+} /* uring_copy */
+
+/* Drop the requests the kernel has not taken yet and wait for the rest
+   to complete, discarding their results. Returns -1 when that fails. */
+int uring_drain(uring *ring, int inflight)
+{
+ unsigned int tail = *ring->sq_tail;
+ unsigned int head;
+ long ret;
+
+ head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+ inflight -= (int)(tail - head);
+ __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+ while (inflight > 0)
+ {
+  head = *ring->cq_head;
+  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  inflight -= (int)(tail - head);
+  __atomic_store_n(ring->cq_head, tail, __ATOMIC_RELEASE);
+  if (inflight <= 0)
+   break;
+  ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS,
+                NULL, 0);
+  if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+   return -1;
+ }
+ return 0;
+} /* uring_drain */
+
+/* Settle a slot once its read and write completed, writes by hand what a
+   short read or short write left over. Returns a command exit code. */
+int uring_finish(uringslot *slot, unsigned char *buf, int outfd, int *stop)
+{
+ size_t done;
+ size_t length;
+ ssize_t written;
+
+ if (slot->read_res < 0)
+  return READ_ERROR;
+ if (slot->write_res == (int)slot->length)
+ {
+  slot->copied = slot->length;
+  return EXIT_OK;
+ }
+ length = (size_t)slot->read_res;
+ if (length > slot->length)
+  length = slot->length;
+ if (length < slot->length)
+ {
+  /* Input shrank under us, what was read is all there is. */
+  *stop = 1;
+ }
+ if (slot->write_res >= 0)
+  done = (size_t)slot->write_res;
+ else if (slot->write_res == -ECANCELED || slot->write_res == -EINVAL)
+  done = 0;
+ else
+  return WRITE_ERROR;
+ if (direct && length % DIRECT_ALIGN != 0)
+  drop_direct(outfd);
+ while (done < length)
+ {
+  written = pwrite(outfd, buf + done, length - done,
+                   (off_t)(slot->offset + done));
+  if (written < 0)
+  {
+   if (errno == EINTR)
+    continue;
+   return WRITE_ERROR;
+  }
+  done += (size_t)written;
+ }
+ slot->copied = length;
+ return EXIT_OK;
+} /* uring_finish */
+#endif
+
+/* Reserve extents for a whole output file without changing its size, so
+   concurrent writers get contiguous layout. Chunked outputs are reserved
+   by prepare_chunks. Only running out of space is an error. */
+int preallocate(copytask *task, int outfd)
+{
+ filedata *fdata = task->fdata;
+
+ if (!prealloc || task->length != COPY_TO_EOF || fdata->size == 0)
+  return EXIT_OK;
+ if (fallocate(outfd, FALLOC_FL_KEEP_SIZE, 0, (off_t)fdata->size) != 0)
+ {
+  if (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)
+  {
+   fprintf(stderr, "Error while preallocating output file: %s\n",
+           fdata->output_name);
+   return WRITE_ERROR;
+  }
+  DPRINT("Preallocation not supported, skipping: %s\n", fdata->output_name);
+ }
+ return EXIT_OK;
+} /* preallocate */
+
+/* Open the replica outputs of a fan-out copy like the first output, one
+   that fails is left out and the others go on. */
+void replicas_open(copytask *task, int whole)
+{
+ filedata *r;
+ copytask rtask = *task;
+ int k;
+
+ for (k = 0, r = task->fdata->replica; r != NULL; k++, r = r->replica)
+ {
+  task->outfds[k] = -1;
+  rtask.fdata = r;
+  if (sync_mode == SYNC_FILE && whole && !r->remote &&
+      access(r->output_name, F_OK) != 0)
+   r->created = 1;
+  if (r->remote)
+  {
+   fprintf(stderr, "Fan-out to a remote output is not supported: %s\n",
+           r->output_name);
+   errno = EOPNOTSUPP;
+   replica_result(r, task, WRITE_ERROR, PHASE_OPEN);
+  }
+  else if ((task->outfds[k] = open_direct(r->output_name, whole ?
+                                          O_WRONLY | O_CREAT | O_TRUNC :
+                                          O_WRONLY)) < 0 ||
+           (!whole && lseek(task->outfds[k], (off_t)task->offset,
+                            SEEK_SET) < 0))
+  {
+   replica_result(r, task, WRITE_ERROR, PHASE_OPEN);
+   fprintf(stderr, "Error while opening output file: %s\n",
+           r->output_name);
+  }
+  else if (preallocate(&rtask, task->outfds[k]) != EXIT_OK)
+   replica_result(r, task, WRITE_ERROR, PHASE_WRITE);
+  else
+   continue;
+  if (task->outfds[k] >= 0)
+   close(task->outfds[k]);
+  task->outfds[k] = -1;
+ }
+} /* replicas_open */
+
+/* Finish the replica outputs the way copyFile finishes the first one. A
+   copy that failed fails them all, opened or not. */
+void replicas_close(copytask *task, int result)
+{
+ filedata *fdata = task->fdata;
+ filedata *r;
+ struct stat st;
+ int whole = task->length == COPY_TO_EOF;
+ int k, fd, phase;
+
+ for (k = 0, r = fdata->replica; r != NULL; k++, r = r->replica)
+ {
+  if ((fd = task->outfds[k]) < 0)
+  {
+   if (result != EXIT_OK)
+    replica_result(r, task, result, PHASE_NONE);
+   continue;
+  }
+  phase = PHASE_NONE;
+  /* Give back preallocated blocks past the end of what was written. */
+  if (result == EXIT_OK && whole && prealloc && fstat(fd, &st) == 0 &&
+      ftruncate(fd, st.st_size) != 0)
+   phase = PHASE_WRITE;
+  if (result == EXIT_OK && !phase && sync_mode >= SYNC_BATCH)
+   sync_file_range(fd, (off_t)task->offset,
+                   whole ? 0 : (off_t)task->length, SYNC_FILE_RANGE_WRITE);
+  if (result == EXIT_OK && !phase && (sync_mode == SYNC_FILE ||
+                                      fdata->verify == VERIFY_SINGLE) &&
+      fdatasync(fd) != 0)
+   phase = PHASE_SYNC;
+  if (result == EXIT_OK && !phase && whole && r->created &&
+      sync_parent(r->output_name) != 0)
+   phase = PHASE_SYNC;
+  if (result == EXIT_OK && !phase && fdata->verify == VERIFY_SINGLE)
+   posix_fadvise(fd, (off_t)task->offset,
+                 whole ? 0 : (off_t)task->length, POSIX_FADV_DONTNEED);
+  if (close(fd) != 0 && result == EXIT_OK && !phase)
+   phase = PHASE_SYNC;
+  task->outfds[k] = -1;
+  if (result != EXIT_OK)
+   replica_result(r, task, result, PHASE_NONE);
+  else if (phase)
+  {
+   replica_result(r, task, WRITE_ERROR, phase);
+   fprintf(stderr, "Error while writing output file: %s\n",
+           r->output_name);
+  }
+ }
+} /* replicas_close */
+
+/* Verify each replica output on its own against the input, with the
+   input digest of the copy for a single-pass verify. */
+void replicas_verify(copytask *task)
+{
+ filedata *r;
+ copytask rtask = *task;
+ int result;
+
+ for (r = task->fdata->replica; r != NULL; r = r->replica)
+ {
+  if (__atomic_load_n(&r->result, __ATOMIC_RELAXED) != EXIT_OK)
+   continue;
+  rtask.fdata = r;
+  errno = 0;
+  if (r->verify == VERIFY_BYTES)
+   result = verify_bytes(&rtask);
+  else
+   result = verify_readback(&rtask);
+  if (result != EXIT_OK)
+   replica_result(r, task, result, PHASE_VERIFY);
+ }
+} /* replicas_verify */
+
+/* Keep the first failure of a replica output, chunks of the copy may
+   fail at the same time. The failure is at phase with the current errno,
+   or the one of the task for PHASE_NONE. */
+void replica_result(filedata *fdata, const copytask *task, int result,
+                    int phase)
+{
+ int err = errno;
+
+ pthread_mutex_lock(&dqueue.lock);
+ if (fdata->result == EXIT_OK)
+ {
+  fdata->result = result;
+  fdata->phase = phase ? phase : task->phase;
+  fdata->err = phase ? err : task->err;
+  fdata->err_offset = phase ? fail_offset(task, phase) : task->err_offset;
+ }
+ pthread_mutex_unlock(&dqueue.lock);
+} /* replica_result */
+
+/* Write a block to the replica outputs of a fan-out copy, one that
+   fails is closed and dropped, leaving the others going. */
+void fanout_write(copytask *task, const unsigned char *buf, size_t len)
+{
+ filedata *r;
+ int k;
+
+ for (k = 0, r = task->fdata->replica; r != NULL; k++, r = r->replica)
+ {
+  if (task->outfds[k] < 0)
+   continue;
+  if (write_all(task->outfds[k], buf, len,
+                latency_hist(task, LAT_WRITE)) != 0)
+  {
+   replica_result(r, task, WRITE_ERROR, PHASE_WRITE);
+   fprintf(stderr, "Error while writing output file: %s\n",
+           r->output_name);
+   close(task->outfds[k]);
+   task->outfds[k] = -1;
+  }
+ }
+} /* fanout_write */
+
+/* Errors meaning the filesystem or kernel can't do this kind of copy,
+   ENOTTY is an ioctl the filesystem lacks. EINVAL also comes back for a
+   range past the end of the input, end of the range asked for, and only
+   falls back while that is within the input. Anything else, like a bad
+   descriptor or an immutable output, is reported. */
+int kcopy_unsupported(int err, int infd, unsigned long int end)
+{
+ struct stat st;
+
+ if (err == ENOSYS || err == EOPNOTSUPP || err == ENOTSUP || err == EXDEV ||
+     err == ENOTTY)
+  return 1;
+ return err == EINVAL && (fstat(infd, &st) != 0 || !S_ISREG(st.st_mode) ||
+                          end <= (unsigned long int)st.st_size);
+} /* kcopy_unsupported */
+
+/* Kernel copies don't say which side failed, guess from errno. */
+int kcopy_error(int err)
+{
+ if (err == ENOSPC || err == EDQUOT || err == EFBIG || err == EROFS ||
+     err == EPERM)
+  return WRITE_ERROR;
+ return READ_ERROR;
+} /* kcopy_error */
+
+/* Open a file, with O_DIRECT when asked for and supported. */
+int open_direct(const char *name, int flags)
+{
+ int fd;
+
+ if (direct)
+ {
+  fd = open(name, flags | O_DIRECT, 0666);
+  if (fd >= 0 || errno != EINVAL)
+   return fd;
+  DPRINT("O_DIRECT not supported, using page cache: %s\n", name);
+ }
+ return open(name, flags, 0666);
+} /* open_direct */
+
+/* O_DIRECT needs aligned offsets and lengths, drop it for the rest of
+   the file once an unaligned tail shows up. Returns 1 when dropped. */
+int drop_direct(int fd)
+{
+ int flags = fcntl(fd, F_GETFL);
+
+ if (flags < 0 || !(flags & O_DIRECT))
+  return 0;
+ return fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+} /* drop_direct */
+
+/* Read until len bytes or end of file, returns bytes read or -1. The
+   whole call is recorded in hist when given. Userspace reads and writes
+   are throttled here and in write_all, a read is charged once done. */
+ssize_t read_full(int fd, unsigned char *buf, size_t len, uint64_t *hist)
+{
+ ssize_t bytes_read;
+ size_t total = 0;
+ uint64_t start;
+
+ start = hist ? monotonic_ns() : 0;
+ while (total < len)
+ {
+  bytes_read = read(fd, buf + total, len - total);
+  if (bytes_read == 0)
+   break;
+  if (bytes_read < 0)
+  {
+   if (errno == EINTR)
+    continue;
+   if (errno == EINVAL && direct && drop_direct(fd))
+    continue;
+   return -1;
+  }
+  total += (size_t)bytes_read;
+ }
+ if (hist)
+  latency_add(hist, start);
+ throttle_io(total, 1);
+ return (ssize_t)total;
+} /* read_full */
+
+int write_all(int fd, const unsigned char *buf, size_t len, uint64_t *hist)
+{
+ ssize_t written;
+ uint64_t start;
+
+ throttle_io(len, 1);
+ start = hist ? monotonic_ns() : 0;
+ while (len > 0)
+ {
+  if (direct && len % DIRECT_ALIGN != 0)
+   drop_direct(fd);
+  written = write(fd, buf, len);
+  if (written < 0)
+  {
+   if (errno == EINTR)
+    continue;
+   return -1;
+  }
+  buf += written;
+  len -= (size_t)written;
+ }
+ if (hist)
+  latency_add(hist, start);
+ return 0;
+} /* write_all */
+
+void *workerThread(void *arg)
+{
+ workerdata *wdata = (workerdata *)arg;
+ workqueue *wq = &wqueue;
+ copytask *task, *next;
+ filedata *fdata;
+ int queue, failed, err;
+ size_t align = (size_t)sysconf(_SC_PAGESIZE);
+
+ if (wdata->pinned && (errno = pthread_setaffinity_np(pthread_self(),
+                                                       sizeof wdata->cpus,
+                                                       &wdata->cpus)) != 0)
+ {
+  fprintf(stderr, "Error pinning worker [%04d]: %s\n", wdata->id,
+          strerror(errno));
+  wdata->node = -1;
+ }
+
+ /* Page aligned buffers, as needed by O_DIRECT. */
+ if (posix_memalign((void **)&wdata->ibuffer, align, blocksize) != 0 ||
+     posix_memalign((void **)&wdata->obuffer, align, blocksize) != 0 ||
+     (ring_depth && posix_memalign((void **)&wdata->ring, align,
+                                   blocksize * (size_t)ring_depth) != 0))
+ {
+  fprintf(stderr, "Error allocating %lu byte buffers for worker [%04d]\n",
+          (unsigned long int)blocksize, wdata->id);
+  exit(READ_ERROR);
+ }
+ /* Pages go to the node of the CPU that first touches them, fault them
+    in here rather than in the middle of the first copy. */
+ if (wdata->pinned)
+ {
+  memset(wdata->ibuffer, 0, blocksize);
+  memset(wdata->obuffer, 0, blocksize);
+  if (ring_depth)
+   memset(wdata->ring, 0, blocksize * (size_t)ring_depth);
+ }
+
+ /* Take queued tasks until the queue is closed and drained, a batch is
+    a chain of small whole file tasks. */
+ while ((task = queue_pop(wq, wdata->node)) != NULL)
+ {
+  /* A probe moves the file to the queue of its devices. */
+  queue = task->fdata->queue;
+  for (; task != NULL; task = next)
+  {
+   /* Main may free a task once it is done, the chain is read first. */
+   next = task->next;
+   task->worker = wdata;
+   fdata = task->fdata;
+   pthread_mutex_lock(&wq->lock);
+   if (fdata->status == TS_INIT && !fdata->probe)
+   {
+    fdata->status = TS_RUNNING;
+    fdata->start = monotonic_ns();
+   }
+   pthread_mutex_unlock(&wq->lock);
+
+   if (fdata->dir)
+   {
+    walkDir(task);
+    if (task->result != EXIT_OK)
+     task_failed(task, PHASE_WALK);
+    done_task(&dqueue, task);
+    queue_close(wq, &dqueue);
+   }
+   else if (fdata->probe)
+   {
+    /* The probe task is replaced by the copy tasks, an input that can't
+       be opened is retried like a failed copy. */
+    failed = probe_file(fdata) != 0;
+    err = errno;
+    if (failed && task->retries < retries)
+     queue_retry(wq, task);
+    else
+    {
+     fdata->probe = 0;
+     if (failed)
+      probe_failed(fdata, err, task->retries);
+     free(fdata->tasks);
+     fdata->tasks = NULL;
+     if (!failed)
+      queue_file(fdata);
+     queue_close(wq, &dqueue);
+    }
+   }
+   else
+   {
+    __atomic_store_n(&wdata->task_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&wdata->task_length, task->length == COPY_TO_EOF ?
+                     fdata->size : task->length, __ATOMIC_RELAXED);
+    __atomic_store_n(&wdata->task_start, monotonic_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&wdata->current, fdata, __ATOMIC_RELEASE);
+    copyFile(task);
+    __atomic_store_n(&wdata->current, NULL, __ATOMIC_RELEASE);
+    /* The file is done once its failed task succeeds or runs out of
+       retries, a fan-out copy can't redo one output alone. */
+    if (task->result != EXIT_OK && task->retries < retries &&
+        !fdata->replicas)
+    {
+     /* The retry copies these bytes again. */
+     __atomic_sub_fetch(&wdata->bytes, __atomic_load_n(&wdata->task_bytes,
+                        __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+     queue_retry(wq, task);
+    }
+    else
+     done_task(&dqueue, task);
+   }
+  }
+  queue_release(wq, queue);
+  if (sync_mode == SYNC_BATCH)
+   sync_flush(&sgroup, 0);
+ }
+ /* Nothing is left for this worker, hand over what is waiting. */
+ if (sync_mode == SYNC_BATCH)
+  sync_flush(&sgroup, 1);
+ if (wdata->pipe)
+  pipe_stop(wdata->pipe);
+ free(wdata->ibuffer);
+ free(wdata->obuffer);
+ free(wdata->ring);
+#ifdef HAVE_IO_URING
+ if (wdata->uring)
+  uring_free(wdata->uring);
+#endif
+ if (wdata->sock >= 0)
+  close(wdata->sock);
+ return NULL;
+} /* workerThread */
+
+/* Fold a finished task into its file, the file is handed to the main
+   thread once its last chunk is in. */
+void done_task(donequeue *dq, copytask *task)
+{
+ filedata *fdata = task->fdata;
+ filedata *r;
+ int held = 0;
+
+ if (journal_fd >= 0 && task->length != COPY_TO_EOF &&
+     task->result == EXIT_OK && !fdata->skip)
+  journal_add(task);
+ pthread_mutex_lock(&dq->lock);
+ if (fdata->result == EXIT_OK && task->result != EXIT_OK)
+ {
+  fdata->result = task->result;
+  fdata->phase = task->phase;
+  fdata->err = task->err;
+  fdata->err_offset = task->err_offset;
+ }
+ if (task->retries > fdata->retries)
+  fdata->retries = task->retries;
+ fdata->engine = task->engine;
+ fdata->open_ns += task->open_ns;
+ fdata->copy_ns += task->copy_ns;
+ fdata->verify_ns += task->verify_ns;
+ if (task->length == COPY_TO_EOF)
+  memcpy(fdata->digest, task->digest, sizeof fdata->digest);
+ if (--fdata->chunks == 0)
+ {
+  fdata->time = elapsed(fdata->start, monotonic_ns());
+  /* Replicas take the times of the copy that wrote them, copied outputs
+     wait for a sync of their group. */
+  for (r = fdata; r != NULL; r = fdata->dir ? NULL : r->replica)
+  {
+   if (r != fdata)
+   {
+    r->time = fdata->time;
+    r->engine = fdata->engine;
+    r->skip = fdata->skip;
+    r->open_ns = fdata->open_ns;
+    r->copy_ns = fdata->copy_ns;
+    r->verify_ns = fdata->verify_ns;
+    memcpy(r->digest, fdata->digest, sizeof r->digest);
+   }
+   if (sync_held(r))
+    held = 1;
+   else
+    done_push(dq, r);
+  }
+ }
+ pthread_mutex_unlock(&dq->lock);
+ for (r = fdata; held && r != NULL; r = r->replica)
+ {
+  if (sync_held(r))
+   sync_add(&sgroup, r);
+ }
+} /* done_task */
+
+/* Note where the running attempt of a task failed, the first failure
+   counts. Call it right after the failing call, errno is taken as is. */
+void task_failed(copytask *task, int phase)
+{
+ if (task->phase != PHASE_NONE)
+  return;
+ task->phase = phase;
+ task->err = errno;
+ task->err_offset = fail_offset(task, phase);
+} /* task_failed */
+
+/* Input offset a failure in phase is at, how far a read or write got in
+   the task or the start of its range otherwise. */
+unsigned long int fail_offset(const copytask *task, int phase)
+{
+ if (phase == PHASE_READ || phase == PHASE_WRITE || phase == PHASE_SEND)
+  return task->offset + __atomic_load_n(&task->worker->task_bytes,
+                                        __ATOMIC_RELAXED);
+ return task->offset;
+} /* fail_offset */
+
+/* Whether a finished output waits for the sync of its group. */
+int sync_held(const filedata *fdata)
+{
+ return sync_mode == SYNC_BATCH && !fdata->dir && !fdata->skip &&
+        !fdata->remote && fdata->result == EXIT_OK;
+} /* sync_held */
+
+/* Hand a file pair to main, called with the completion queue locked. */
+void done_push(donequeue *dq, filedata *fdata)
+{
+ if (!fdata->dir)
+  __atomic_add_fetch(&files_done, 1, __ATOMIC_RELAXED);
+ fdata->status = TS_DONE;
+ if (dq->tail == dq->size)
+ {
+  dq->size = dq->size ? dq->size * 2 : TABLE_SEGMENT;
+  if ((dq->items = realloc(dq->items, (size_t)dq->size *
+                           sizeof *dq->items)) == NULL)
+  {
+   fprintf(stderr, "Error allocating completion queue\n");
+   exit(READ_ERROR);
+  }
+ }
+ dq->items[dq->tail++] = fdata;
+ pthread_cond_signal(&dq->cond);
+} /* done_push */
+
+/* Add a copied file pair to the sync group, the worker that fills it up
+   does the sync. */
+void sync_add(syncgroup *sg, filedata *fdata)
+{
+ int full;
+
+ pthread_mutex_lock(&sg->lock);
+ if (sg->count == sg->size)
+ {
+  sg->size = sg->size ? sg->size * 2 : SYNC_BATCH_FILES;
+  if ((sg->items = realloc(sg->items, (size_t)sg->size *
+                           sizeof *sg->items)) == NULL)
+  {
+   fprintf(stderr, "Error allocating sync group\n");
+   exit(WRITE_ERROR);
+  }
+ }
+ if (sg->count == 0)
+  sg->start = monotonic_ns();
+ sg->items[sg->count++] = fdata;
+ sg->bytes += fdata->size;
+ full = sg->count >= SYNC_BATCH_FILES || sg->bytes >= SYNC_BATCH_BYTES;
+ pthread_mutex_unlock(&sg->lock);
+ sync_flush(sg, full);
+} /* sync_add */
+
+/* Sync a group that is full, old enough or forced, then hand its file
+   pairs to main. Workers go on filling a new group meanwhile. */
+void sync_flush(syncgroup *sg, int force)
+{
+ filedata **items = NULL;
+ int count = 0, i;
+
+ pthread_mutex_lock(&sg->lock);
+ if (sg->count > 0 &&
+     (force || monotonic_ns() - sg->start >= SYNC_BATCH_NS))
+ {
+  items = sg->items;
+  count = sg->count;
+  sg->items = NULL;
+  sg->count = 0;
+  sg->size = 0;
+  sg->bytes = 0;
+ }
+ pthread_mutex_unlock(&sg->lock);
+ if (count == 0)
+  return;
+ DPRINT("Syncing %d finished file(s)\n", count);
+ sync_outputs(items, count);
+ pthread_mutex_lock(&dqueue.lock);
+ for (i = 0; i < count; i++)
+  done_push(&dqueue, items[i]);
+ pthread_mutex_unlock(&dqueue.lock);
+ free(items);
+} /* sync_flush */
+
+/* syncfs each filesystem the outputs are on once, through the first
+   output on it, outputs on one that failed get WRITE_ERROR. Returns 0
+   when all are synced. */
+int sync_outputs(filedata **items, int count)
+{
+ dev_t *devs;
+ int *failed;
+ int ndevs = 0, i, k, fd, result = 0;
+
+ if ((devs = malloc((size_t)count * sizeof *devs)) == NULL ||
+     (failed = malloc((size_t)count * sizeof *failed)) == NULL)
+ {
+  fprintf(stderr, "Error allocating sync list\n");
+  exit(WRITE_ERROR);
+ }
+ for (i = 0; i < count; i++)
+ {
+  if (items[i]->remote)
+   continue;
+  for (k = 0; k < ndevs && devs[k] != items[i]->out_dev; k++)
+   ;
+  if (k == ndevs)
+  {
+   devs[ndevs] = items[i]->out_dev;
+   if ((fd = open(items[i]->output_name, O_RDONLY)) < 0)
+    fd = open(items[i]->output_name, O_WRONLY);
+   failed[ndevs] = fd < 0 || syncfs(fd) != 0 ? errno : 0;
+   if (fd >= 0)
+    close(fd);
+   if (failed[ndevs])
+    fprintf(stderr, "Error while syncing filesystem of output file: %s\n",
+            items[i]->output_name);
+   ndevs++;
+  }
+  if (failed[k])
+  {
+   items[i]->result = WRITE_ERROR;
+   items[i]->phase = PHASE_SYNC;
+   items[i]->err = failed[k];
+   items[i]->err_offset = 0;
+   result = -1;
+  }
+ }
+ free(devs);
+ free(failed);
+ return result;
+} /* sync_outputs */
+
+/* With a sync policy write-back of the output is started every
+   WRITEBACK_BYTES written, so the final sync has little left to wait
+   for. */
+void sync_written(copytask *task, unsigned long int bytes)
+{
+ if (sync_mode != SYNC_NONE && task->outfd >= 0 &&
+     (task->unflushed += bytes) >= WRITEBACK_BYTES)
+ {
+  sync_file_range(task->outfd, 0, 0, SYNC_FILE_RANGE_WRITE);
+  task->unflushed = 0;
+ }
+} /* sync_written */
+
+/* fsync the directory holding path, a new name is only durable once
+   that is done. Returns 0 on success. */
+int sync_parent(const char *path)
+{
+ const char *slash = strrchr(path, '/');
+ char *dir;
+ int fd, result = -1;
+
+ if (slash == NULL)
+  dir = strdup(".");
+ else
+  dir = strndup(path, slash == path ? 1 : (size_t)(slash - path));
+ if (dir != NULL && (fd = open(dir, O_RDONLY | O_DIRECTORY)) >= 0)
+ {
+  result = fsync(fd);
+  if (close(fd) != 0)
+   result = -1;
+ }
+ free(dir);
+ return result;
+} /* sync_parent */
+
+/* Returns NULL once every queued file pair has been collected. */
+filedata *done_pop(donequeue *dq)
+{
+ filedata *fdata = NULL;
+
+ pthread_mutex_lock(&dq->lock);
+ while (dq->head == dq->tail && !(dq->closed && dq->head == dq->expected))
+  pthread_cond_wait(&dq->cond, &dq->lock);
+ if (dq->head < dq->tail)
+  fdata = dq->items[dq->head++];
+ pthread_mutex_unlock(&dq->lock);
+ return fdata;
+} /* done_pop */
+
+/* Read the file list entry by entry and queue each pair right away. */
+void *feedFiles(void *arg)
+{
+ feeder *feed = (feeder *)arg;
+ char *line = NULL, *output = NULL;
+ size_t line_size = 0, output_size = 0;
+ ssize_t len;
+ unsigned long int entry = 0;
+ char *tab;
+
+ for (;;)
+ {
+  if ((len = getdelim(&line, &line_size, feed->delim, feed->list)) < 0)
+   break;
+  entry++;
+  if (feed->delim == '\0')
+  {
+   /* Input and output are separate NUL terminated strings. */
+   if (getdelim(&output, &output_size, '\0', feed->list) < 0)
+   {
+    fprintf(stderr, "Missing output for entry %lu in file list: %s\n",
+            entry, line);
+    feed->skipped++;
+    break;
+   }
+   tab = output;
+  }
+  else
+  {
+   while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    line[--len] = '\0';
+   if (len == 0)
+    continue;
+   if ((tab = strchr(line, '\t')) == NULL)
+   {
+    fprintf(stderr, "Bad entry on line %lu in file list: %s\n", entry, line);
+    feed->skipped++;
+    continue;
+   }
+   *tab++ = '\0';
+  }
+  if (strcmp(line, tab) == 0)
+  {
+   fprintf(stderr, "Input and output are same on entry %lu in file list: "
+                   "%s\n", entry, line);
+   feed->skipped++;
+   continue;
+  }
+  add_file(line, tab, feed->queued + feed->skipped, feed->verify, 1, NULL,
+           NULL);
+  feed->queued++;
+ }
+ if (ferror(feed->list))
+ {
+  fprintf(stderr, "Error while reading file list: %s\n", feed->name);
+  feed->result = READ_ERROR;
+ }
+ free(line);
+ free(output);
+ queue_close(&wqueue, &dqueue);
+ return NULL;
+} /* feedFiles */
+
+/* Add a file pair to the table and queue it, returns 0 when the input is
+   missing. A negative index keeps the table position. With async the
+   probe is queued for a worker instead of done here. The NULL terminated
+   extra outputs or those of the parent directory make a fan-out copy. */
+int add_file(const char *input, const char *output, int index, int verify,
+             int async, const filedata *parent, char *const *extra)
+{
+ filedata *fdata;
+
+ if ((fdata = table_add(&ftable, input, output)) == NULL)
+ {
+  fprintf(stderr, "Error allocating file table for: %s\n", input);
+  exit(READ_ERROR);
+ }
+ if (index >= 0)
+  fdata->index = index;
+ fdata->verify = verify;
+ fdata->remote = remote_path(fdata->output_name, NULL, 0, NULL) != NULL;
+ add_replicas(fdata, extra, parent);
+ if (async)
+ {
+  queue_probe(fdata);
+  return 1;
+ }
+ if (probe_file(fdata) != 0)
+ {
+  probe_failed(fdata, errno, 0);
+  return 0;
+ }
+ queue_file(fdata);
+ return 1;
+} /* add_file */
+
+/* Queue a probe of the input, the worker running it queues the copy. */
+void queue_probe(filedata *fdata)
+{
+ workqueue *wq = &wqueue;
+ copytask *task;
+
+ if ((task = calloc(1, sizeof *task)) == NULL)
+ {
+  fprintf(stderr, "Error allocating probe task for: %s\n",
+          fdata->input_name);
+  exit(READ_ERROR);
+ }
+ task->fdata = fdata;
+ fdata->probe = 1;
+ fdata->tasks = task;
+ pthread_mutex_lock(&wq->lock);
+ fdata->queue = queue_index(wq, fdata);
+ queue_push(wq, task);
+ wq->producers++;
+ pthread_cond_broadcast(&wq->cond);
+ pthread_mutex_unlock(&wq->lock);
+} /* queue_probe */
+
+/* Queue a directory to be walked by a worker, extra as for add_file. */
+int add_dir(const char *input, const char *output, int verify,
+            const filedata *parent, char *const *extra)
+{
+ filedata *fdata;
+
+ if ((fdata = table_add(&ftable, input, output)) == NULL)
+ {
+  fprintf(stderr, "Error allocating file table for: %s\n", input);
+  exit(READ_ERROR);
+ }
+ fdata->verify = verify;
+ fdata->dir = 1;
+ fdata->remote = remote_path(fdata->output_name, NULL, 0, NULL) != NULL;
+ add_replicas(fdata, extra, parent);
+ queue_file(fdata);
+ return 1;
+} /* add_dir */
+
+/* Hang the further outputs of a fan-out copy off fdata, taken from the
+   extra list or, for an entry of a walked directory, from the outputs of
+   that directory. */
+void add_replicas(filedata *fdata, char *const *extra,
+                  const filedata *parent)
+{
+ filedata *r, **tail = &fdata->replica;
+ const char *name;
+ char *path;
+
+ name = strrchr(fdata->output_name, '/');
+ name = name ? name + 1 : fdata->output_name;
+ for (;;)
+ {
+  if (parent)
+  {
+   if ((parent = parent->replica) == NULL)
+    break;
+   if (asprintf(&path, "%s/%s", parent->output_name, name) < 0)
+    path = NULL;
+  }
+  else
+  {
+   if (extra == NULL || *extra == NULL)
+    break;
+   path = strdup(*extra++);
+  }
+  if (path && *path == '\0')
+  {
+   free(path);
+   continue;
+  }
+  if (path == NULL ||
+      (r = table_add(&ftable, fdata->input_name, path)) == NULL)
+  {
+   fprintf(stderr, "Error allocating file table for: %s\n",
+           fdata->input_name);
+   exit(READ_ERROR);
+  }
+  free(path);
+  r->index = fdata->index;
+  r->verify = fdata->verify;
+  r->dir = fdata->dir;
+  r->remote = remote_path(r->output_name, NULL, 0, NULL) != NULL;
+  *tail = r;
+  tail = &r->replica;
+  fdata->replicas++;
+ }
+} /* add_replicas */
+
+/* Create the destination directory and queue every entry of the source,
+   subdirectories are walked by whichever worker picks them up next. */
+void walkDir(copytask *task)
+{
+ filedata *fdata = task->fdata;
+ char *buffer = (char *)task->worker->ibuffer;
+ size_t bsize = blocksize < DENTS_SIZE ? blocksize : DENTS_SIZE;
+ char *ipath = NULL, *opath = NULL;
+ size_t ilen = strlen(fdata->input_name);
+ size_t olen = strlen(fdata->output_name);
+ size_t nlen;
+ dirent64 *ent;
+ struct stat st;
+ filedata *r;
+ long int nread, pos;
+ int dirfd;
+ int type;
+
+ task->engine = ENGINE_AUTO;
+ if ((dirfd = open(fdata->input_name, O_RDONLY | O_DIRECTORY)) < 0 ||
+     fstat(dirfd, &st) != 0)
+ {
+  fprintf(stderr, "Error while opening directory: %s\n", fdata->input_name);
+  task->result = READ_ERROR;
+  if (dirfd >= 0)
+   close(dirfd);
+  return;
+ }
+ /* A receiver creates directories as files arrive. The source mode
+    could keep the entries out, it is applied once they are copied. */
+ for (r = fdata; r != NULL; r = r->replica)
+ {
+  if (r->remote)
+   continue;
+  if (mkdir(r->output_name, 0700) != 0 && errno != EEXIST)
+  {
+   fprintf(stderr, "Error while creating directory: %s\n", r->output_name);
+   task->result = WRITE_ERROR;
+   close(dirfd);
+   return;
+  }
+  r->mode = st.st_mode;
+ }
+
+ for (;;)
+ {
+  nread = syscall(SYS_getdents64, dirfd, buffer, bsize);
+  if (nread == 0)
+   break;
+  if (nread < 0)
+  {
+   fprintf(stderr, "Error while reading directory: %s\n", fdata->input_name);
+   task->result = READ_ERROR;
+   break;
+  }
+  for (pos = 0; pos < nread; pos += ent->d_reclen)
+  {
+   ent = (dirent64 *)(buffer + pos);
+   if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+    continue;
+   type = ent->d_type;
+   if (type == DT_UNKNOWN)
+   {
+    if (fstatat(dirfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+     continue;
+    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+   }
+   if (type != DT_DIR && type != DT_REG)
+   {
+    DPRINT("Skipped special file: %s/%s\n", fdata->input_name, ent->d_name);
+    continue;
+   }
+   /* Paths are built here, the file table keeps its own copy. */
+   nlen = strlen(ent->d_name);
+   free(ipath);
+   free(opath);
+   ipath = malloc(ilen + nlen + 2);
+   opath = malloc(olen + nlen + 2);
+   if (ipath == NULL || opath == NULL)
+   {
+    fprintf(stderr, "Error allocating path in: %s\n", fdata->input_name);
+    exit(READ_ERROR);
+   }
+   sprintf(ipath, "%s/%s", fdata->input_name, ent->d_name);
+   sprintf(opath, "%s/%s", fdata->output_name, ent->d_name);
+   if (type == DT_DIR)
+    add_dir(ipath, opath, fdata->verify, fdata, NULL);
+   else
+    add_file(ipath, opath, -1, fdata->verify, 0, fdata, NULL);
+  }
+ }
+ free(ipath);
+ free(opath);
+ close(dirfd);
+} /* walkDir */
+
+/* Plan chunks, each chunk is a task of its own for the worker pool.
+   Skipped pairs and journaled chunks are not queued. */
+void queue_file(filedata *fdata)
+{
+ workqueue *wq = &wqueue;
+ donequeue *dq = &dqueue;
+ unsigned long int c, nchunks = 1, pending, bytes = 0;
+ copytask *tasks;
+ devqueue *q;
+ filedata *r;
+ struct stat st;
+ int chunked, keep = 0;
+
+ /* Journaled chunks are only trusted while the output is at full size. */
+ chunked = !fdata->dir && !fdata->skip && chunksize &&
+           fdata->size > chunksize;
+ if (chunked && journal_count && !fdata->replicas &&
+     stat(fdata->output_name, &st) == 0 &&
+     (unsigned long int)st.st_size == fdata->size)
+  keep = 1;
+ for (r = fdata->replica; chunked && r != NULL; r = r->replica)
+ {
+  if (!r->remote && prepare_chunks(r, 0) != 0)
+   chunked = 0;
+ }
+ if (chunked && (fdata->remote ||
+                 prepare_chunks(fdata, keep || engine == ENGINE_DELTA) == 0))
+  nchunks = (fdata->size + chunksize - 1) / chunksize;
+ else
+  keep = 0;
+ if (nchunks > 1 && fdata->infd >= 0)
+ {
+  /* Chunks open their own descriptors. */
+  close(fdata->infd);
+  fdata->infd = -1;
+  __atomic_sub_fetch(&fds_held, 1, __ATOMIC_RELAXED);
+ }
+ if ((tasks = calloc(nchunks, sizeof *tasks)) == NULL)
+ {
+  fprintf(stderr, "Error allocating %lu copy tasks for: %s\n", nchunks,
+          fdata->input_name);
+  exit(READ_ERROR);
+ }
+ fdata->tasks = tasks;
+ pending = 0;
+ for (c = 0; c < nchunks; c++)
+ {
+  tasks[c].fdata = fdata;
+  tasks[c].offset = c * chunksize;
+  tasks[c].length = nchunks == 1 ? COPY_TO_EOF :
+   (c + 1 < nchunks ? chunksize : fdata->size - c * chunksize);
+  if (keep && journal_done(fdata, tasks[c].offset, tasks[c].length))
+   continue;
+  pending++;
+  bytes += nchunks == 1 ? fdata->size : tasks[c].length;
+ }
+ if (fdata->skip || pending == 0)
+ {
+  fdata->skip = 1;
+  pending = 1;
+  bytes = 0;
+ }
+ fdata->chunks = (int)pending;
+
+ /* Every output of a fan-out copy is collected on its own. */
+ pthread_mutex_lock(&dq->lock);
+ dq->expected += fdata->dir ? 1 : 1 + fdata->replicas;
+ pthread_mutex_unlock(&dq->lock);
+ if (!fdata->dir)
+ {
+  __atomic_add_fetch(&files_total, 1 + fdata->replicas, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&bytes_total, bytes, __ATOMIC_RELAXED);
+ }
+ if (fdata->skip)
+ {
+  /* Nothing to copy, hand the pair straight to the main thread. */
+  fdata->start = monotonic_ns();
+  done_task(dq, &tasks[0]);
+  DPRINT("Queued file pair [%04d] as unchanged: %s -> %s\n", fdata->index,
+         fdata->input_name, fdata->output_name);
+  return;
+ }
+
+ pthread_mutex_lock(&wq->lock);
+ fdata->queue = queue_index(wq, fdata);
+ q = &wq->queues[fdata->queue];
+ if (nchunks == 1 && !fdata->dir && schedule != SCHEDULE_FIFO &&
+     fdata->size < BATCH_SMALL)
+ {
+  /* Small files ride along in a batch of their devices, pushed once it
+     is full or a worker runs out of other work. */
+  if (q->batch == NULL)
+   q->batch = tasks;
+  else
+   q->batch_tail->next = tasks;
+  q->batch_tail = tasks;
+  q->batch_files++;
+  q->batch_bytes += fdata->size;
+  if (q->batch_files >= BATCH_FILES || q->batch_bytes >= BATCH_BYTES)
+  {
+   queue_push(wq, q->batch);
+   q->batch = NULL;
+   q->batch_files = 0;
+   q->batch_bytes = 0;
+  }
+ }
+ else
+ {
+  for (c = 0; c < nchunks; c++)
+  {
+   if (!keep || !journal_done(fdata, tasks[c].offset, tasks[c].length))
+    queue_push(wq, &tasks[c]);
+  }
+ }
+ if (fdata->dir)
+  wq->producers++;
+ pthread_cond_broadcast(&wq->cond);
+ pthread_mutex_unlock(&wq->lock);
+ if (fdata->dir)
+ {
+  DPRINT("Queued directory [%04d] walk: %s -> %s\n", fdata->index,
+         fdata->input_name, fdata->output_name);
+ }
+ else
+ {
+  DPRINT("Queued file pair [%04d] in %lu of %lu chunk(s) with file copy: "
+         "%s -> %s\n", fdata->index, pending, nchunks, fdata->input_name,
+         fdata->output_name);
+ }
+} /* queue_file */
+
+/* Add a task, or the head of a batch, to its lane. Called with the queue
+   locked. */
+void queue_push(workqueue *wq, copytask *task)
+{
+ copytask *t;
+ unsigned long int bytes = 0;
+ int lane = 0;
+
+ for (t = task; t != NULL; t = t->next)
+  bytes += t->length == COPY_TO_EOF ? t->fdata->size : t->length;
+ task->seq = wq->seq++;
+ task->key = 0;
+ if (schedule == SCHEDULE_LARGEST)
+  task->key = task->fdata->dir || task->fdata->probe ? ~0UL : bytes;
+ else if (schedule == SCHEDULE_INTERLEAVE && !task->fdata->dir &&
+          !task->fdata->probe &&
+          (task->next != NULL || bytes < BATCH_SMALL))
+  lane = 1;
+ heap_push(&wq->queues[task->fdata->queue].lanes[lane], task);
+ wq->queued++;
+} /* queue_push */
+
+/* Hold a failed task back for its backoff, queue_pop puts it on its
+   queue again once it is due. The wait doubles with each retry. */
+void queue_retry(workqueue *wq, copytask *task)
+{
+ copytask **p;
+ uint64_t wait = RETRY_BACKOFF_NS;
+ int i;
+
+ for (i = 0; i < task->retries && wait < RETRY_BACKOFF_MAX_NS; i++)
+  wait *= 2;
+ if (wait > RETRY_BACKOFF_MAX_NS)
+  wait = RETRY_BACKOFF_MAX_NS;
+ task->retries++;
+ task->due = monotonic_ns() + wait;
+ task->next = NULL;
+ PRINT("Retrying [%04d] in %.0f second(s), %d of %d: %s -> %s\n",
+       task->fdata->index, (double)wait / 1e9, task->retries, retries,
+       task->fdata->input_name, task->fdata->output_name);
+ pthread_mutex_lock(&wq->lock);
+ for (p = &wq->retry; *p != NULL && (*p)->due <= task->due; p = &(*p)->next)
+  ;
+ task->next = *p;
+ *p = task;
+ pthread_cond_broadcast(&wq->cond);
+ pthread_mutex_unlock(&wq->lock);
+} /* queue_retry */
+
+/* Take the next task, blocking while producers are still running. The
+   best task goes first among queues whose devices have a slot free, idle
+   workers take a partly filled batch rather than wait for it. Queues on
+   the node of a placed worker win over better tasks elsewhere. */
+copytask *queue_pop(workqueue *wq, int node)
+{
+ copytask *task = NULL;
+ copytask *t;
+ devqueue *q;
+ struct timespec ts;
+ uint64_t now = 0, wait;
+ int i, lane, best, best_lane = 0, pending, local, best_local = 0, pass;
+
+ pthread_mutex_lock(&wq->lock);
+ for (;;)
+ {
+  /* Retries whose backoff is over compete like any other task. */
+  if (wq->retry)
+   now = monotonic_ns();
+  while (wq->retry && wq->retry->due <= now)
+  {
+   t = wq->retry;
+   wq->retry = t->next;
+   t->next = NULL;
+   queue_push(wq, t);
+  }
+  best = -1;
+  pending = wq->retry != NULL;
+  for (i = 0; i < wq->nqueues; i++)
+  {
+   q = &wq->queues[i];
+   pending += q->lanes[0].count + q->lanes[1].count + (q->batch != NULL);
+   if (!queue_ready(wq, q))
+    continue;
+   lane = schedule == SCHEDULE_INTERLEAVE ? q->turn : 0;
+   if (q->lanes[lane].count == 0)
+    lane ^= 1;
+   local = node < 0 || q->node < 0 || q->node == node;
+   if (q->lanes[lane].count > 0 &&
+       (best < 0 || local > best_local ||
+        (local == best_local &&
+         task_before(q->lanes[lane].items[0],
+                     wq->queues[best].lanes[best_lane].items[0]))))
+   {
+    best = i;
+    best_lane = lane;
+    best_local = local;
+   }
+  }
+  if (best >= 0)
+  {
+   q = &wq->queues[best];
+   task = heap_pop(&q->lanes[best_lane]);
+   q->turn = best_lane ^ 1;
+   break;
+  }
+  for (pass = node < 0; pass < 2 && task == NULL; pass++)
+  {
+   for (i = 0; i < wq->nqueues && task == NULL; i++)
+   {
+    q = &wq->queues[i];
+    if (q->batch && queue_ready(wq, q) &&
+        (pass || q->node < 0 || q->node == node))
+    {
+     task = q->batch;
+     q->batch = NULL;
+     q->batch_files = 0;
+     q->batch_bytes = 0;
+    }
+   }
+  }
+  /* Tasks held back by busy devices wait for a slot, retries for their
+     time. */
+  if (task || (wq->closed && pending == 0))
+   break;
+  if (wq->retry)
+  {
+   wait = wq->retry->due - now;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   ts.tv_sec += (time_t)(wait / 1000000000ULL);
+   ts.tv_nsec += (long)(wait % 1000000000ULL);
+   if (ts.tv_nsec >= 1000000000L)
+   {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+   }
+   pthread_cond_timedwait(&wq->cond, &wq->lock, &ts);
+  }
+  else
+   pthread_cond_wait(&wq->cond, &wq->lock);
+ }
+ if (task)
+  queue_take(wq, &wq->queues[task->fdata->queue], 1);
+ pthread_mutex_unlock(&wq->lock);
+ return task;
+} /* queue_pop */
+
+/* Whether both devices of a queue can take another task. */
+int queue_ready(const workqueue *wq, const devqueue *q)
+{
+ const device *d;
+
+ if (q->in >= 0)
+ {
+  d = &wq->devices[q->in];
+  if (d->limit && d->active >= d->limit)
+   return 0;
+ }
+ if (q->out >= 0 && q->out != q->in)
+ {
+  d = &wq->devices[q->out];
+  if (d->limit && d->active >= d->limit)
+   return 0;
+ }
+ return 1;
+} /* queue_ready */
+
+/* Count a task taken from or given back to a queue on its devices. */
+void queue_take(workqueue *wq, const devqueue *q, int count)
+{
+ if (q->in >= 0)
+  wq->devices[q->in].active += count;
+ if (q->out >= 0 && q->out != q->in)
+  wq->devices[q->out].active += count;
+} /* queue_take */
+
+/* A task, or a whole batch, from queue is done. */
+void queue_release(workqueue *wq, int queue)
+{
+ pthread_mutex_lock(&wq->lock);
+ queue_take(wq, &wq->queues[queue], -1);
+ if (wq->queues[queue].in >= 0)
+  pthread_cond_broadcast(&wq->cond);
+ pthread_mutex_unlock(&wq->lock);
+} /* queue_release */
+
+/* Find or add the queue for the devices of a file pair, called with the
+   queue locked. Probes and directory walks go to queue 0. */
+int queue_index(workqueue *wq, const filedata *fdata)
+{
+ int in, out, i;
+
+ if (wq->nqueues == 0)
+  queue_add(wq, -1, -1);
+ if (fdata->dir || fdata->probe)
+  return 0;
+ in = device_index(wq, fdata->in_dev);
+ out = device_index(wq, fdata->out_dev);
+ for (i = 1; i < wq->nqueues; i++)
+ {
+  if (wq->queues[i].in == in && wq->queues[i].out == out)
+   return i;
+ }
+ return queue_add(wq, in, out);
+} /* queue_index */
+
+int queue_add(workqueue *wq, int in, int out)
+{
+ devqueue *queues;
+
+ if ((queues = realloc(wq->queues, (size_t)(wq->nqueues + 1) *
+                       sizeof *queues)) == NULL)
+ {
+  fprintf(stderr, "Error allocating work queue\n");
+  exit(READ_ERROR);
+ }
+ wq->queues = queues;
+ memset(&queues[wq->nqueues], 0, sizeof *queues);
+ queues[wq->nqueues].in = in;
+ queues[wq->nqueues].out = out;
+ queues[wq->nqueues].node = in >= 0 && wq->devices[in].node >= 0 ?
+                            wq->devices[in].node :
+                            out >= 0 ? wq->devices[out].node : -1;
+ return wq->nqueues++;
+} /* queue_add */
+
+/* Find or add a device, its limit is --dev-jobs or tuned by whether the
+   block device behind it is rotational. Called with the queue locked. */
+int device_index(workqueue *wq, dev_t dev)
+{
+ device *devices;
+ int i;
+
+ for (i = 0; i < wq->ndevices; i++)
+ {
+  if (wq->devices[i].dev == dev)
+   return i;
+ }
+ if ((devices = realloc(wq->devices, (size_t)(wq->ndevices + 1) *
+                        sizeof *devices)) == NULL)
+ {
+  fprintf(stderr, "Error allocating device table\n");
+  exit(READ_ERROR);
+ }
+ wq->devices = devices;
+ devices[i].dev = dev;
+ devices[i].active = 0;
+ devices[i].limit = dev_jobs ? dev_jobs :
+                    device_rotational(dev) ? DEV_ROTATIONAL_JOBS : 0;
+ devices[i].node = nnodes ? device_node(dev) : -1;
+ DPRINT("Device %u:%u task limit: %d, node: %d\n", major(dev), minor(dev),
+        devices[i].limit, devices[i].node);
+ return wq->ndevices++;
+} /* device_index */
+
+/* Whether sysfs reports the block device, or the disk a partition is on,
+   as rotational. Anything else, like NFS or tmpfs, is not. */
+int device_rotational(dev_t dev)
+{
+ char name[64];
+ FILE *fp;
+ int rotational = 0;
+
+ snprintf(name, sizeof name, "/sys/dev/block/%u:%u/queue/rotational",
+          major(dev), minor(dev));
+ if ((fp = fopen(name, "r")) == NULL)
+ {
+  snprintf(name, sizeof name, "/sys/dev/block/%u:%u/../queue/rotational",
+           major(dev), minor(dev));
+  fp = fopen(name, "r");
+ }
+ if (fp == NULL)
+  return 0;
+ if (fscanf(fp, "%d", &rotational) != 1)
+  rotational = 0;
+ fclose(fp);
+ return rotational;
+} /* device_rotational */
+
+/* NUMA node of the controller a block device hangs off, the first
+   numa_node attribute found walking up its sysfs path. */
+int device_node(dev_t dev)
+{
+ char link[64], path[PATH_MAX + 16], *slash;
+ size_t len;
+ FILE *fp;
+ int node = -1;
+
+ snprintf(link, sizeof link, "/sys/dev/block/%u:%u", major(dev), minor(dev));
+ if (realpath(link, path) == NULL)
+  return -1;
+ len = strlen(path);
+ while (len > strlen("/sys/devices"))
+ {
+  snprintf(path + len, sizeof path - len, "/numa_node");
+  if ((fp = fopen(path, "r")) != NULL)
+  {
+   if (fscanf(fp, "%d", &node) != 1)
+    node = -1;
+   fclose(fp);
+   break;
+  }
+  path[len] = '\0';
+  if ((slash = strrchr(path, '/')) == NULL)
+   break;
+  *slash = '\0';
+  len = (size_t)(slash - path);
+ }
+ return node;
+} /* device_node */
+
+/* Device an output is or will be on, that of its directory when it does
+   not exist yet. */
+dev_t output_dev(const char *name)
+{
+ struct stat st;
+ char *dir, *slash;
+
+ if (stat(name, &st) == 0)
+  return st.st_dev;
+ st.st_dev = 0;
+ if ((dir = strdup(name)) == NULL)
+  return 0;
+ if ((slash = strrchr(dir, '/')) == NULL)
+  stat(".", &st);
+ else if (slash == dir)
+  stat("/", &st);
+ else
+ {
+  *slash = '\0';
+  stat(dir, &st);
+ }
+ free(dir);
+ return st.st_dev;
+} /* output_dev */
+
+int task_before(const copytask *a, const copytask *b)
+{
+ if (a->key != b->key)
+  return a->key > b->key;
+ return a->seq < b->seq;
+} /* task_before */
+
+void heap_push(taskheap *h, copytask *task)
+{
+ copytask **items;
+ int i, parent;
+
+ if (h->count == h->size)
+ {
+  h->size = h->size ? h->size * 2 : TABLE_SEGMENT;
+  if ((items = realloc(h->items, (size_t)h->size * sizeof *items)) == NULL)
+  {
+   fprintf(stderr, "Error allocating work queue\n");
+   exit(READ_ERROR);
+  }
+  h->items = items;
+ }
+ for (i = h->count++; i > 0; i = parent)
+ {
+  parent = (i - 1) / 2;
+  if (!task_before(task, h->items[parent]))
+   break;
+  h->items[i] = h->items[parent];
+ }
+ h->items[i] = task;
+} /* heap_push */
+
+copytask *heap_pop(taskheap *h)
+{
+ copytask *top = h->items[0];
+ copytask *last = h->items[--h->count];
+ int i = 0, child;
+
+ for (;;)
+ {
+  child = 2 * i + 1;
+  if (child >= h->count)
+   break;
+  if (child + 1 < h->count && task_before(h->items[child + 1],
+                                          h->items[child]))
+   child++;
+  if (!task_before(h->items[child], last))
+   break;
+  h->items[i] = h->items[child];
+  i = child;
+ }
+ if (h->count > 0)
+  h->items[i] = last;
+ return top;
+} /* heap_pop */
+
+/* A producer is done, once the last one is, idle workers exit and main
+   stops collecting when the queued file pairs are in. */
+void queue_close(workqueue *wq, donequeue *dq)
+{
+ devqueue *q;
+ int last, i;
+
+ pthread_mutex_lock(&wq->lock);
+ last = --wq->producers == 0;
+ if (last)
+ {
+  for (i = 0; i < wq->nqueues; i++)
+  {
+   q = &wq->queues[i];
+   if (q->batch)
+   {
+    queue_push(wq, q->batch);
+    q->batch = NULL;
+    q->batch_files = 0;
+    q->batch_bytes = 0;
+   }
+  }
+  wq->closed = 1;
+  pthread_cond_broadcast(&wq->cond);
+ }
+ pthread_mutex_unlock(&wq->lock);
+ if (!last)
+  return;
+ pthread_mutex_lock(&dq->lock);
+ dq->closed = 1;
+ pthread_cond_signal(&dq->cond);
+ pthread_mutex_unlock(&dq->lock);
+} /* queue_close */
+
+/* Add a file pair to the table, names are copied into the arena. */
+filedata *table_add(filetable *t, const char *input, const char *output)
+{
+ filedata **segments;
+ filedata *fdata = NULL;
+ int seg;
+
+ pthread_mutex_lock(&t->lock);
+ seg = t->count / TABLE_SEGMENT;
+ if (seg == t->nsegments)
+ {
+  segments = realloc(t->segments, (size_t)(seg + 1) * sizeof *segments);
+  if (segments != NULL)
+  {
+   t->segments = segments;
+   if ((t->segments[seg] = calloc(TABLE_SEGMENT, sizeof **segments)) != NULL)
+    t->nsegments++;
+  }
+ }
+ if (seg < t->nsegments)
+ {
+  fdata = &t->segments[seg][t->count % TABLE_SEGMENT];
+  if ((fdata->input_name = table_path(t, input)) != NULL &&
+      (fdata->output_name = table_path(t, output)) != NULL)
+  {
+   fdata->index = t->count++;
+   fdata->status = TS_INIT;
+   fdata->infd = -1;
+  }
+  else
+  {
+   fdata = NULL;
+  }
+ }
+ pthread_mutex_unlock(&t->lock);
+ return fdata;
+} /* table_add */
+
+/* Entry i of the table, NULL past the last one. */
+filedata *table_get(const filetable *t, int i)
+{
+ if (i < 0 || i >= t->count)
+  return NULL;
+ return &t->segments[i / TABLE_SEGMENT][i % TABLE_SEGMENT];
+} /* table_get */
+
+/* Copy a path into the arena, long paths get a block of their own. */
+char *table_path(filetable *t, const char *path)
+{
+ size_t len = strlen(path) + 1;
+ size_t size;
+ arenablock *block = t->arena;
+ char *copy;
+
+ if (block == NULL || block->size - block->used < len)
+ {
+  size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+  if ((block = malloc(sizeof *block + size)) == NULL)
+   return NULL;
+  block->used = 0;
+  block->size = size;
+  block->next = t->arena;
+  t->arena = block;
+ }
+ copy = block->data + block->used;
+ memcpy(copy, path, len);
+ block->used += len;
+ return copy;
+} /* table_path */
+
+void table_free(filetable *t)
+{
+ arenablock *next;
+ int i;
+
+ for (i = 0; i < t->nsegments; i++)
+  free(t->segments[i]);
+ free(t->segments);
+ while (t->arena)
+ {
+  next = t->arena->next;
+  free(t->arena);
+  t->arena = next;
+ }
+ memset(t, 0, sizeof *t);
+} /* table_free */
+
+/* Split a delimited file list in place, *fn gets an array of pointers
+   into farg which the caller frees. */
+unsigned int get_filenames(char *farg, char ***fn)
+{
+ char *tstr, *saveptr, *token;
+ char **names = NULL, **grown;
+ int i;
+ int numf = 0;
+ if (strlen(farg) > 0)
+ {
+   if (strstr(farg, DELIMITER) == NULL)
+   {
+    if ((names = malloc(sizeof *names)) == NULL)
+     return 0;
+    names[0] = farg;
+    *fn = names;
+    return 1;
+   }
+ }
+ else
+ {
+  return 0;
+ }
+ for (i = 0, tstr = farg; ; i++, tstr = NULL)
+ {
+  token = strtok_r(tstr, DELIMITER, &saveptr);
+  if (token == NULL)
+  {
+   numf = i;
+   break;
+  }
+  if ((i & (i - 1)) == 0)
+  {
+   /* Double at powers of two. */
+   if ((grown = realloc(names, (size_t)(i ? i * 2 : 1) * sizeof *names)) ==
+       NULL)
+   {
+    free(names);
+    return 0;
+   }
+   names = grown;
+  }
+  names[i] = token;
+ }
+ if (numf > 0)
+  numf -= 1;
+ *fn = names;
+ return numf;
+}
+
+/* Returns the offset of the first differing byte, or len when equal.
+   memcmp does the bulk work, libc already dispatches it to the widest
+   vector unit at runtime, a word-wide scan then locates the mismatch
+   within the first differing stride. */
+size_t compare_block(const unsigned char *a, const unsigned char *b,
+                     size_t len)
+{
+ size_t pos = 0;
+ size_t stride;
+ uint64_t wa, wb, diff;
+
+ while (pos < len)
+ {
+  stride = len - pos < COMPARE_STRIDE ? len - pos : COMPARE_STRIDE;
+  if (memcmp(a + pos, b + pos, stride) != 0)
+   break;
+  pos += stride;
+ }
+ if (pos == len)
+  return len;
+
+ for (; pos + sizeof wa <= len; pos += sizeof wa)
+ {
+  memcpy(&wa, a + pos, sizeof wa);
+  memcpy(&wb, b + pos, sizeof wb);
+  diff = wa ^ wb;
+  if (diff)
+  {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+   return pos + (size_t)(__builtin_clzll(diff) / 8);
+#else
+   return pos + (size_t)(__builtin_ctzll(diff) / 8);
+#endif
+  }
+ }
+ for (; pos < len; pos++)
+ {
+  if (a[pos] != b[pos])
+   return pos;
+ }
+ return len;
+} /* compare_block */
+
+/* XXH64, streaming 64-bit hash used for single-pass verification. */
+static uint64_t xxh64_rotl(uint64_t x, int r)
+{
+ return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh64_read64(const unsigned char *p)
+{
+ uint64_t v;
+
+ memcpy(&v, p, sizeof v);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+ v = __builtin_bswap64(v);
+#endif
+ return v;
+}
+
+static uint32_t xxh64_read32(const unsigned char *p)
+{
+ uint32_t v;
+
+ memcpy(&v, p, sizeof v);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+ v = __builtin_bswap32(v);
+#endif
+ return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+ acc += input * XXH_PRIME64_2;
+ acc = xxh64_rotl(acc, 31);
+ return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+ acc ^= xxh64_round(0, val);
+ return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void xxh64_init(xxh64state *state)
+{
+ memset(state, 0, sizeof *state);
+ state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+ state->v[1] = XXH_PRIME64_2;
+ state->v[2] = 0;
+ state->v[3] = 0 - XXH_PRIME64_1;
+} /* xxh64_init */
+
+void xxh64_update(xxh64state *state, const unsigned char *buf, size_t len)
+{
+ const unsigned char *end = buf + len;
+
+ state->total_len += len;
+ if (state->memsize + len < 32)
+ {
+  memcpy(state->mem + state->memsize, buf, len);
+  state->memsize += (unsigned int)len;
+  return;
+ }
+ if (state->memsize)
+ {
+  memcpy(state->mem + state->memsize, buf, 32 - state->memsize);
+  state->v[0] = xxh64_round(state->v[0], xxh64_read64(state->mem));
+  state->v[1] = xxh64_round(state->v[1], xxh64_read64(state->mem + 8));
+  state->v[2] = xxh64_round(state->v[2], xxh64_read64(state->mem + 16));
+  state->v[3] = xxh64_round(state->v[3], xxh64_read64(state->mem + 24));
+  buf += 32 - state->memsize;
+  state->memsize = 0;
+ }
+ while (buf + 32 <= end)
+ {
+  state->v[0] = xxh64_round(state->v[0], xxh64_read64(buf));
+  state->v[1] = xxh64_round(state->v[1], xxh64_read64(buf + 8));
+  state->v[2] = xxh64_round(state->v[2], xxh64_read64(buf + 16));
+  state->v[3] = xxh64_round(state->v[3], xxh64_read64(buf + 24));
+  buf += 32;
+ }
+ if (buf < end)
+ {
+  memcpy(state->mem, buf, (size_t)(end - buf));
+  state->memsize = (unsigned int)(end - buf);
+ }
+} /* xxh64_update */
+
+uint64_t xxh64_digest(const xxh64state *state)
+{
+ const unsigned char *p = state->mem;
+ const unsigned char *end = p + state->memsize;
+ uint64_t h;
+
+ if (state->total_len >= 32)
+ {
+  h = xxh64_rotl(state->v[0], 1) + xxh64_rotl(state->v[1], 7) +
+      xxh64_rotl(state->v[2], 12) + xxh64_rotl(state->v[3], 18);
+  h = xxh64_merge(h, state->v[0]);
+  h = xxh64_merge(h, state->v[1]);
+  h = xxh64_merge(h, state->v[2]);
+  h = xxh64_merge(h, state->v[3]);
+ }
+ else
+ {
+  h = state->v[2] + XXH_PRIME64_5;
+ }
+ h += state->total_len;
+ while (p + 8 <= end)
+ {
+  h ^= xxh64_round(0, xxh64_read64(p));
+  h = xxh64_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+  p += 8;
+ }
+ if (p + 4 <= end)
+ {
+  h ^= (uint64_t)xxh64_read32(p) * XXH_PRIME64_1;
+  h = xxh64_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+  p += 4;
+ }
+ while (p < end)
+ {
+  h ^= (uint64_t)*p * XXH_PRIME64_5;
+  h = xxh64_rotl(h, 11) * XXH_PRIME64_1;
+  p++;
+ }
+ h ^= h >> 33;
+ h *= XXH_PRIME64_2;
+ h ^= h >> 29;
+ h *= XXH_PRIME64_3;
+ h ^= h >> 32;
+ return h;
+} /* xxh64_digest */
+
+void hash_init(hashstate *state, int alg)
+{
+ state->alg = alg;
+ if (alg == HASH_CRC32C)
+  state->u.crc32c = 0xFFFFFFFF;
+ else if (alg == HASH_BLAKE3)
+  blake3_init(&state->u.blake3);
+ else
+  xxh64_init(&state->u.xxh64);
+} /* hash_init */
+
+void hash_update(hashstate *state, const unsigned char *buf, size_t len)
+{
+ if (state->alg == HASH_CRC32C)
+  state->u.crc32c = crc32c_update(state->u.crc32c, buf, len);
+ else if (state->alg == HASH_BLAKE3)
+  blake3_update(&state->u.blake3, buf, len);
+ else
+  xxh64_update(&state->u.xxh64, buf, len);
+} /* hash_update */
+
+/* Digests come out big-endian for xxh64 and crc32c, like xxhsum does. */
+void hash_final(const hashstate *state, unsigned char *digest)
+{
+ uint64_t v;
+ int i;
+
+ if (state->alg == HASH_BLAKE3)
+ {
+  blake3_final(&state->u.blake3, digest);
+  return;
+ }
+ if (state->alg == HASH_CRC32C)
+  v = (uint64_t)(state->u.crc32c ^ 0xFFFFFFFF);
+ else
+  v = xxh64_digest(&state->u.xxh64);
+ for (i = hash_lens[state->alg] - 1; i >= 0; i--, v >>= 8)
+  digest[i] = (unsigned char)v;
+} /* hash_final */
+
+void hash_hex(const unsigned char *digest, int alg, char *hex)
+{
+ int i;
+
+ for (i = 0; i < hash_lens[alg]; i++)
+  sprintf(hex + i * 2, "%02x", digest[i]);
+} /* hash_hex */
+
+/* CRC32C, SSE4.2 crc32 instruction when the CPU has it. */
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static int crc32c_hw = 0;
+
+static void crc32c_setup(void)
+{
+ uint32_t crc;
+ int i, j;
+
+ for (i = 0; i < 256; i++)
+ {
+  crc = (uint32_t)i;
+  for (j = 0; j < 8; j++)
+   crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+  crc32c_table[i] = crc;
+ }
+#if defined(__x86_64__)
+ crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *buf,
+                             size_t len)
+{
+ uint64_t crc64 = crc;
+ uint64_t word;
+
+ for (; len >= sizeof word; len -= sizeof word, buf += sizeof word)
+ {
+  memcpy(&word, buf, sizeof word);
+  crc64 = __builtin_ia32_crc32di(crc64, word);
+ }
+ crc = (uint32_t)crc64;
+ for (; len > 0; len--, buf++)
+  crc = __builtin_ia32_crc32qi(crc, *buf);
+ return crc;
+}
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const unsigned char *buf, size_t len)
+{
+ pthread_once(&crc32c_once, crc32c_setup);
+#if defined(__x86_64__)
+ if (crc32c_hw)
+  return crc32c_sse42(crc, buf, len);
+#endif
+ for (; len > 0; len--, buf++)
+  crc = (crc >> 8) ^ crc32c_table[(crc ^ *buf) & 0xFF];
+ return crc;
+} /* crc32c_update */
+
+/* BLAKE3, portable single-threaded version of the reference design. */
+static const uint32_t blake3_iv[8] =
+{
+ 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+ 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const unsigned char blake3_perm[16] =
+{
+ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8
+};
+
+static uint32_t blake3_rotr(uint32_t x, int r)
+{
+ return (x >> r) | (x << (32 - r));
+}
+
+static void blake3_g(uint32_t *v, int a, int b, int c, int d, uint32_t mx,
+                     uint32_t my)
+{
+ v[a] = v[a] + v[b] + mx;
+ v[d] = blake3_rotr(v[d] ^ v[a], 16);
+ v[c] = v[c] + v[d];
+ v[b] = blake3_rotr(v[b] ^ v[c], 12);
+ v[a] = v[a] + v[b] + my;
+ v[d] = blake3_rotr(v[d] ^ v[a], 8);
+ v[c] = v[c] + v[d];
+ v[b] = blake3_rotr(v[b] ^ v[c], 7);
+}
+
+/* Compress one 64 byte block, out gets all 16 state words. */
+static void blake3_compress(const uint32_t cv[8], const unsigned char *block,
+                            uint64_t counter, uint32_t block_len,
+                            uint32_t flags, uint32_t out[16])
+{
+ uint32_t m[16], t[16];
+ int i, r;
+
+ for (i = 0; i < 16; i++)
+  m[i] = (uint32_t)block[i * 4] | (uint32_t)block[i * 4 + 1] << 8 |
+         (uint32_t)block[i * 4 + 2] << 16 | (uint32_t)block[i * 4 + 3] << 24;
+ for (i = 0; i < 8; i++)
+  out[i] = cv[i];
+ for (i = 0; i < 4; i++)
+  out[8 + i] = blake3_iv[i];
+ out[12] = (uint32_t)counter;
+ out[13] = (uint32_t)(counter >> 32);
+ out[14] = block_len;
+ out[15] = flags;
+ for (r = 0; r < 7; r++)
+ {
+  blake3_g(out, 0, 4, 8, 12, m[0], m[1]);
+  blake3_g(out, 1, 5, 9, 13, m[2], m[3]);
+  blake3_g(out, 2, 6, 10, 14, m[4], m[5]);
+  blake3_g(out, 3, 7, 11, 15, m[6], m[7]);
+  blake3_g(out, 0, 5, 10, 15, m[8], m[9]);
+  blake3_g(out, 1, 6, 11, 12, m[10], m[11]);
+  blake3_g(out, 2, 7, 8, 13, m[12], m[13]);
+  blake3_g(out, 3, 4, 9, 14, m[14], m[15]);
+  for (i = 0; i < 16; i++)
+   t[i] = m[blake3_perm[i]];
+  memcpy(m, t, sizeof m);
+ }
+ for (i = 0; i < 8; i++)
+ {
+  out[i] ^= out[i + 8];
+  out[i + 8] ^= cv[i];
+ }
+}
+
+static void blake3_parent(const uint32_t key[8], const uint32_t left[8],
+                          const uint32_t right[8], uint32_t flags,
+                          uint32_t out[16])
+{
+ unsigned char block[BLAKE3_BLOCK_LEN];
+ int i;
+
+ for (i = 0; i < 8; i++)
+ {
+  block[i * 4] = (unsigned char)left[i];
+  block[i * 4 + 1] = (unsigned char)(left[i] >> 8);
+  block[i * 4 + 2] = (unsigned char)(left[i] >> 16);
+  block[i * 4 + 3] = (unsigned char)(left[i] >> 24);
+  block[32 + i * 4] = (unsigned char)right[i];
+  block[32 + i * 4 + 1] = (unsigned char)(right[i] >> 8);
+  block[32 + i * 4 + 2] = (unsigned char)(right[i] >> 16);
+  block[32 + i * 4 + 3] = (unsigned char)(right[i] >> 24);
+ }
+ blake3_compress(key, block, 0, BLAKE3_BLOCK_LEN, BLAKE3_PARENT | flags, out);
+}
+
+void blake3_init(blake3state *state)
+{
+ memset(state, 0, sizeof *state);
+ memcpy(state->key, blake3_iv, sizeof state->key);
+ memcpy(state->cv, blake3_iv, sizeof state->cv);
+} /* blake3_init */
+
+void blake3_update(blake3state *state, const unsigned char *buf, size_t len)
+{
+ uint32_t out[16];
+ uint64_t total;
+ size_t take;
+
+ while (len > 0)
+ {
+  /* A full block is only compressed once more input shows up, so the
+     last block of the last chunk is left for blake3_final. */
+  if (state->block_len == BLAKE3_BLOCK_LEN)
+  {
+   if (state->blocks_compressed + 1 == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN)
+   {
+    /* Chunk complete, push its chaining value and merge subtrees. */
+    blake3_compress(state->cv, state->block, state->chunk_counter,
+                    BLAKE3_BLOCK_LEN, BLAKE3_CHUNK_END, out);
+    total = ++state->chunk_counter;
+    while ((total & 1) == 0)
+    {
+     state->cv_stack_len--;
+     blake3_parent(state->key, state->cv_stack[state->cv_stack_len], out, 0,
+                   out);
+     total >>= 1;
+    }
+    memcpy(state->cv_stack[state->cv_stack_len++], out,
+           sizeof state->cv_stack[0]);
+    memcpy(state->cv, state->key, sizeof state->cv);
+    state->blocks_compressed = 0;
+   }
+   else
+   {
+    blake3_compress(state->cv, state->block, state->chunk_counter,
+                    BLAKE3_BLOCK_LEN,
+                    state->blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0,
+                    out);
+    memcpy(state->cv, out, sizeof state->cv);
+    state->blocks_compressed++;
+   }
+   state->block_len = 0;
+  }
+  take = BLAKE3_BLOCK_LEN - state->block_len;
+  if (take > len)
+   take = len;
+  memcpy(state->block + state->block_len, buf, take);
+  state->block_len += (unsigned int)take;
+  buf += take;
+  len -= take;
+ }
+} /* blake3_update */
+
+void blake3_final(const blake3state *state, unsigned char *digest)
+{
+ unsigned char block[BLAKE3_BLOCK_LEN];
+ uint32_t cv[8], out[16];
+ uint32_t flags;
+ unsigned int n;
+ int i;
+
+ /* Output node of the current chunk, zero padded last block. */
+ memset(block, 0, sizeof block);
+ memcpy(block, state->block, state->block_len);
+ flags = BLAKE3_CHUNK_END;
+ if (state->blocks_compressed == 0)
+  flags |= BLAKE3_CHUNK_START;
+ n = state->cv_stack_len;
+ if (n == 0)
+ {
+  blake3_compress(state->cv, block, state->chunk_counter, state->block_len,
+                  flags | BLAKE3_ROOT, out);
+ }
+ else
+ {
+  blake3_compress(state->cv, block, state->chunk_counter, state->block_len,
+                  flags, out);
+  /* Fold the stack, the last parent is the root. */
+  while (n > 0)
+  {
+   n--;
+   memcpy(cv, out, sizeof cv);
+   blake3_parent(state->key, state->cv_stack[n], cv,
+                 n == 0 ? BLAKE3_ROOT : 0, out);
+  }
+ }
+ for (i = 0; i < 8; i++)
+ {
+  digest[i * 4] = (unsigned char)out[i];
+  digest[i * 4 + 1] = (unsigned char)(out[i] >> 8);
+  digest[i * 4 + 2] = (unsigned char)(out[i] >> 16);
+  digest[i * 4 + 3] = (unsigned char)(out[i] >> 24);
+ }
+} /* blake3_final */
+
+/* Parse a size with optional K, M or G suffix, returns 0 when valid. */
+int parse_size(const char *arg, unsigned long int *size)
+{
+ char *end;
+ unsigned long int value;
+
+ errno = 0;
+ value = strtoul(arg, &end, 10);
+ if (errno != 0 || end == arg)
+  return -1;
+ switch (toupper((unsigned char)*end))
+ {
+  case 'G':
+   value <<= 10;
+   /* fall through */
+  case 'M':
+   value <<= 10;
+   /* fall through */
+  case 'K':
+   value <<= 10;
+   end++;
+   break;
+  case '\0':
+   break;
+  default:
+   return -1;
+ }
+ if (*end != '\0')
+  return -1;
+ *size = value;
+ return 0;
+} /* parse_size */
+
+/* Parse a bandwidth, a bare number is MiB/s, with a suffix bytes/s. */
+int parse_rate(const char *arg, unsigned long int *rate)
+{
+ size_t len = strlen(arg);
+
+ if (parse_size(arg, rate) != 0)
+  return -1;
+ if (len > 0 && isdigit((unsigned char)arg[len - 1]))
+  *rate <<= 20;
+ return 0;
+} /* parse_rate */
+
+/* CPU list like 0-3,8,10-11, as taken by taskset and found in sysfs. */
+int parse_cpus(const char *arg, cpu_set_t *set)
+{
+ char *end;
+ long int first, last;
+
+ CPU_ZERO(set);
+ for (;;)
+ {
+  first = strtol(arg, &end, 10);
+  if (end == arg || first < 0 || first >= CPU_SETSIZE)
+   return -1;
+  last = first;
+  if (*end == '-')
+  {
+   arg = end + 1;
+   last = strtol(arg, &end, 10);
+   if (end == arg || last < first || last >= CPU_SETSIZE)
+    return -1;
+  }
+  for (; first <= last; first++)
+   CPU_SET((int)first, set);
+  if (*end != ',')
+   break;
+  arg = end + 1;
+ }
+ return *end == '\0' || *end == '\n' ? 0 : -1;
+} /* parse_cpus */
+
+/* Read the CPUs of each NUMA node from sysfs, keeping nodes with any of
+   the allowed CPUs. Returns the number of nodes kept. */
+int numa_setup(const cpu_set_t *allowed)
+{
+ char name[64], list[4096];
+ cpu_set_t cpus;
+ FILE *fp;
+ int n;
+
+ for (n = 0; n < NODES_MAX; n++)
+ {
+  snprintf(name, sizeof name, "/sys/devices/system/node/node%d/cpulist", n);
+  if ((fp = fopen(name, "r")) == NULL)
+   continue;
+  if (fgets(list, sizeof list, fp) != NULL && parse_cpus(list, &cpus) == 0)
+  {
+   CPU_AND(&cpus, &cpus, allowed);
+   if (CPU_COUNT(&cpus) > 0)
+   {
+    node_cpus[nnodes] = cpus;
+    node_ids[nnodes++] = n;
+   }
+  }
+  fclose(fp);
+ }
+ return nnodes;
+} /* numa_setup */
+
+/* Workers go round robin over the NUMA nodes, free to run on any CPU of
+   their node, or else each is pinned to the next CPU of --cpus. */
+void place_worker(workerdata *wdata)
+{
+ int cpu, k;
+
+ wdata->node = -1;
+ wdata->pinned = 0;
+ CPU_ZERO(&wdata->cpus);
+ if (nnodes)
+ {
+  wdata->cpus = node_cpus[wdata->id % nnodes];
+  wdata->node = node_ids[wdata->id % nnodes];
+  wdata->pinned = 1;
+ }
+ else if (cpu_pin)
+ {
+  k = wdata->id % CPU_COUNT(&cpu_list);
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+  {
+   if (CPU_ISSET(cpu, &cpu_list) && k-- == 0)
+    break;
+  }
+  CPU_SET(cpu, &wdata->cpus);
+  wdata->pinned = 1;
+ }
+ if (wdata->pinned)
+  DPRINT("Worker [%04d] node: %d, CPUs: %d\n", wdata->id, wdata->node,
+         CPU_COUNT(&wdata->cpus));
+} /* place_worker */
+
+/* Draw from both buckets for ops reads or writes of bytes each. */
+void throttle_io(unsigned long int bytes, unsigned long int ops)
+{
+ throttle_take(&bw_limit, bytes * ops);
+ throttle_take(&iops_limit, ops);
+} /* throttle_io */
+
+/* Reserve units with one compare and swap on the time the bucket runs
+   dry, then sleep until the reservation falls within the burst. */
+void throttle_take(throttle *bucket, unsigned long int units)
+{
+ unsigned long int rate = __atomic_load_n(&bucket->rate, __ATOMIC_RELAXED);
+ uint64_t now, start, next, cost, wait;
+ struct timespec ts;
+
+ if (rate == 0)
+  return;
+ cost = (uint64_t)((double)units * 1e9 / (double)rate);
+ now = monotonic_ns();
+ next = __atomic_load_n(&bucket->next, __ATOMIC_RELAXED);
+ do
+ {
+  /* An idle bucket saves nothing up beyond the burst allowance. */
+  start = next < now ? now : next;
+ } while (!__atomic_compare_exchange_n(&bucket->next, &next, start + cost, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+ if (start + cost <= now + THROTTLE_BURST)
+  return;
+ wait = start + cost - now - THROTTLE_BURST;
+ ts.tv_sec = (time_t)(wait / 1000000000ULL);
+ ts.tv_nsec = (long)(wait % 1000000000ULL);
+ while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+  ;
+} /* throttle_take */
+
+uint64_t monotonic_ns(void)
+{
+ struct timespec ts;
+
+ clock_gettime(CLOCK_MONOTONIC, &ts);
+ return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+} /* monotonic_ns */
+
+double elapsed(uint64_t start, uint64_t end)
+{
+ return (double)(end - start) / 1000000000;
+} /* elapsed */
+
+/* Count copied bytes for the progress reporter, no locks. */
+void progress_add(copytask *task, unsigned long int bytes)
+{
+ __atomic_add_fetch(&task->worker->bytes, bytes, __ATOMIC_RELAXED);
+ __atomic_add_fetch(&task->worker->task_bytes, bytes, __ATOMIC_RELAXED);
+} /* progress_add */
+
+/* Print aggregate throughput, files done, ETA and the files that have been
+   in flight longest every progress seconds. Only reads worker counters. */
+void *progressThread(void *arg)
+{
+ uint64_t now, last = monotonic_ns(), start;
+ unsigned long int bytes, last_bytes = 0, total, length, left;
+ double rate, eta;
+ workerdata *slow[PROGRESS_SLOW];
+ uint64_t slow_start[PROGRESS_SLOW];
+ filedata *fdata;
+ struct timespec ts;
+ int interval, i, j, n;
+
+ (void)arg;
+ while ((interval = __atomic_load_n(&progress, __ATOMIC_RELAXED)) > 0)
+ {
+  /* Sleep in short steps so the end of the run is not held up. */
+  for (i = 0; i < interval * 10 && __atomic_load_n(&progress,
+                                                   __ATOMIC_RELAXED); i++)
+  {
+   ts.tv_sec = 0;
+   ts.tv_nsec = 100000000;
+   nanosleep(&ts, NULL);
+  }
+  if (!__atomic_load_n(&progress, __ATOMIC_RELAXED))
+   break;
+
+  now = monotonic_ns();
+  bytes = 0;
+  n = 0;
+  for (i = 0; i < nworkers; i++)
+  {
+   bytes += __atomic_load_n(&workers[i].bytes, __ATOMIC_RELAXED);
+   if (__atomic_load_n(&workers[i].current, __ATOMIC_ACQUIRE) == NULL)
+    continue;
+   /* Keep the longest running tasks, oldest first. */
+   start = __atomic_load_n(&workers[i].task_start, __ATOMIC_RELAXED);
+   if (n == PROGRESS_SLOW && start >= slow_start[n - 1])
+    continue;
+   for (j = n < PROGRESS_SLOW ? n++ : PROGRESS_SLOW - 1;
+        j > 0 && slow_start[j - 1] > start; j--)
+   {
+    slow[j] = slow[j - 1];
+    slow_start[j] = slow_start[j - 1];
+   }
+   slow[j] = &workers[i];
+   slow_start[j] = start;
+  }
+  rate = (double)(bytes - last_bytes) * 1e9 / (double)(now - last);
+  total = __atomic_load_n(&bytes_total, __ATOMIC_RELAXED);
+  left = bytes < total ? total - bytes : 0;
+  eta = rate > 0 ? (double)left / rate : 0;
+  printf("Progress: %d/%d file(s), %.1f/%.1f MiB, %.1f MiB/s, "
+         "ETA %d:%02d:%02d\n",
+         __atomic_load_n(&files_done, __ATOMIC_RELAXED),
+         __atomic_load_n(&files_total, __ATOMIC_RELAXED),
+         (double)bytes / 1048576, (double)total / 1048576, rate / 1048576,
+         (int)eta / 3600, (int)eta / 60 % 60, (int)eta % 60);
+  for (i = 0; i < n; i++)
+  {
+   /* File entries outlive the run, a stale one only skews one line. */
+   fdata = __atomic_load_n(&slow[i]->current, __ATOMIC_ACQUIRE);
+   if (fdata == NULL)
+    continue;
+   length = __atomic_load_n(&slow[i]->task_length, __ATOMIC_RELAXED);
+   printf("  [%04d] %.1f second(s), %3.0f%%: %s\n", fdata->index,
+          (double)(now - slow_start[i]) / 1e9, length ? 100.0 *
+          (double)__atomic_load_n(&slow[i]->task_bytes, __ATOMIC_RELAXED) /
+          (double)length : 0.0, fdata->input_name);
+  }
+  fflush(stdout);
+  last = now;
+  last_bytes = bytes;
+ }
+ return NULL;
+} /* progressThread */
+
+/* Read 'bwlimit=<rate>' and 'iops-limit=<n>' lines, other lines and
+   '#' comments are ignored. Returns 0 when the file could be read. */
+int load_control(const char *name)
+{
+ FILE *fp;
+ char line[256];
+ char *value;
+ unsigned long int rate;
+
+ if ((fp = fopen(name, "r")) == NULL)
+ {
+  fprintf(stderr, "Error while opening control file: %s\n", name);
+  return -1;
+ }
+ while (fgets(line, sizeof line, fp) != NULL)
+ {
+  line[strcspn(line, "\r\n")] = '\0';
+  if (line[0] == '#' || (value = strchr(line, '=')) == NULL)
+   continue;
+  *value++ = '\0';
+  if (strcmp(line, "bwlimit") == 0 && parse_rate(value, &rate) == 0)
+   __atomic_store_n(&bw_limit.rate, rate, __ATOMIC_RELAXED);
+  else if (strcmp(line, "iops-limit") == 0 && parse_size(value, &rate) == 0)
+   __atomic_store_n(&iops_limit.rate, rate, __ATOMIC_RELAXED);
+  else
+   fprintf(stderr, "Ignoring control file line: %s=%s\n", line, value);
+ }
+ fclose(fp);
+ return 0;
+} /* load_control */
+
+/* Reload the control file on SIGUSR1 or when its mtime changes. */
+void *controlThread(void *arg)
+{
+ const char *name = (const char *)arg;
+ sigset_t sigs;
+ struct timespec timeout = { CONTROL_POLL, 0 };
+ struct stat st;
+ struct timespec mtime = { 0, 0 };
+ int sig;
+
+ sigemptyset(&sigs);
+ sigaddset(&sigs, SIGUSR1);
+ if (stat(name, &st) == 0)
+  mtime = st.st_mtim;
+ for (;;)
+ {
+  sig = sigtimedwait(&sigs, NULL, &timeout);
+  if (__atomic_load_n(&control_stop, __ATOMIC_RELAXED))
+   break;
+  if (stat(name, &st) != 0)
+   continue;
+  if (sig != SIGUSR1 && st.st_mtim.tv_sec == mtime.tv_sec &&
+      st.st_mtim.tv_nsec == mtime.tv_nsec)
+   continue;
+  mtime = st.st_mtim;
+  if (load_control(name) == 0)
+   PRINT("Limits reloaded, bandwidth %lu bytes/s, IOPS %lu\n",
+         __atomic_load_n(&bw_limit.rate, __ATOMIC_RELAXED),
+         __atomic_load_n(&iops_limit.rate, __ATOMIC_RELAXED));
+ }
+ return NULL;
+} /* controlThread */
+
+/* Histogram of the task's worker for a LAT_* kind, NULL unless --stats. */
+uint64_t *latency_hist(copytask *task, int kind)
+{
+ if (task->worker->lat == NULL)
+  return NULL;
+ return task->worker->lat + kind * HIST_BUCKETS;
+} /* latency_hist */
+
+/* Count the time since start, histograms are only touched by the worker
+   they belong to and its pipeline writer, which records writes only. */
+void latency_add(uint64_t *hist, uint64_t start)
+{
+ if (hist)
+  hist[hist_bucket(monotonic_ns() - start)]++;
+} /* latency_add */
+
+/* Log-linear bucket, HIST_SUB linear steps per power of two so the
+   relative error stays under 12.5% at any latency. */
+int hist_bucket(uint64_t ns)
+{
+ int msb;
+
+ if (ns < HIST_SUB)
+  return (int)ns;
+ msb = 63 - __builtin_clzll(ns);
+ return (msb - 2) * HIST_SUB + (int)((ns >> (msb - 3)) & (HIST_SUB - 1));
+} /* hist_bucket */
+
+/* Largest ns value counted in a bucket. */
+uint64_t hist_upper(int bucket)
+{
+ int msb = bucket / HIST_SUB + 2;
+
+ if (bucket < HIST_SUB)
+  return (uint64_t)bucket;
+ return ((uint64_t)(HIST_SUB + bucket % HIST_SUB + 1) << (msb - 3)) - 1;
+} /* hist_upper */
+
+/* Upper bound of the bucket holding the pct percentile sample. */
+uint64_t hist_percentile(const uint64_t *hist, uint64_t count, double pct)
+{
+ uint64_t rank = (uint64_t)((double)count * pct / 100 + 0.999999);
+ uint64_t seen = 0;
+ int i;
+
+ if (rank == 0)
+  rank = 1;
+ for (i = 0; i < HIST_BUCKETS; i++)
+ {
+  seen += hist[i];
+  if (seen >= rank)
+   return hist_upper(i);
+ }
+ return 0;
+} /* hist_percentile */
+
+/* Quote a path as JSON string or CSV field, depending on stats. */
+void stats_string(FILE *out, const char *str)
+{
+ const unsigned char *c;
+
+ fputc('"', out);
+ for (c = (const unsigned char *)str; *c; c++)
+ {
+  if (stats == STATS_CSV)
+  {
+   if (*c == '"')
+    fputc('"', out);
+   fputc(*c, out);
+  }
+  else if (*c == '"' || *c == '\\')
+   fprintf(out, "\\%c", *c);
+  else if (*c < 0x20)
+   fprintf(out, "\\u%04x", *c);
+  else
+   fputc(*c, out);
+ }
+ fputc('"', out);
+} /* stats_string */
+
+/* Write per file timings and the merged LAT_* histograms of all workers
+   as JSON or CSV. Returns 0 when everything was written. */
+int write_stats(FILE *out, const uint64_t *lat, double total)
+{
+ static const double pcts[] = { 50, 90, 99, 99.9 };
+ static const char *pct_names[] = { "p50", "p90", "p99", "p999" };
+ filedata *fdata;
+ const uint64_t *hist;
+ uint64_t count;
+ unsigned long int bytes = 0;
+ int files = 0, failed = 0, first = 1;
+ int i, k, p, max;
+
+ if (stats == STATS_JSON)
+  fprintf(out, "{\n  \"files\": [");
+ else
+  fprintf(out, "index,input,output,size,engine,result,open_ms,copy_ms,"
+               "verify_ms,time_ms,bytes_per_sec,phase,errno,error_offset,"
+               "retries\n");
+ for (i = 0; (fdata = table_get(&ftable, i)) != NULL; i++)
+ {
+  if (fdata->dir || fdata->status != TS_CHECKED)
+   continue;
+  files++;
+  if (fdata->result != EXIT_OK)
+   failed++;
+  else
+   bytes += fdata->size;
+  if (stats == STATS_JSON)
+  {
+   fprintf(out, "%s\n    { \"index\": %d, \"input\": ", first ? "" : ",",
+           fdata->index);
+   stats_string(out, fdata->input_name);
+   fprintf(out, ", \"output\": ");
+   stats_string(out, fdata->output_name);
+   fprintf(out, ", \"size\": %lu, \"engine\": \"%s\", \"result\": %d, "
+           "\"open_ms\": %.3f, \"copy_ms\": %.3f, \"verify_ms\": %.3f, "
+           "\"time_ms\": %.3f, \"bytes_per_sec\": %.0f",
+           fdata->size, engines[fdata->engine].name, fdata->result,
+           (double)fdata->open_ns / 1e6, (double)fdata->copy_ns / 1e6,
+           (double)fdata->verify_ns / 1e6, fdata->time * 1e3,
+           fdata->time > 0 ? (double)fdata->size / fdata->time : 0.0);
+   /* Where and why it failed. */
+   if (fdata->result != EXIT_OK)
+   {
+    fprintf(out, ", \"phase\": \"%s\", \"errno\": %d, \"error\": ",
+            phase_names[fdata->phase], fdata->err);
+    stats_string(out, fdata->err ? strerror(fdata->err) : "");
+    fprintf(out, ", \"error_offset\": %lu", fdata->err_offset);
+   }
+   fprintf(out, ", \"retries\": %d }", fdata->retries);
+  }
+  else
+  {
+   fprintf(out, "%d,", fdata->index);
+   stats_string(out, fdata->input_name);
+   fputc(',', out);
+   stats_string(out, fdata->output_name);
+   fprintf(out, ",%lu,%s,%d,%.3f,%.3f,%.3f,%.3f,%.0f,%s,%d,%lu,%d\n",
+           fdata->size, engines[fdata->engine].name, fdata->result,
+           (double)fdata->open_ns / 1e6, (double)fdata->copy_ns / 1e6,
+           (double)fdata->verify_ns / 1e6, fdata->time * 1e3,
+           fdata->time > 0 ? (double)fdata->size / fdata->time : 0.0,
+           phase_names[fdata->phase], fdata->err, fdata->err_offset,
+           fdata->retries);
+  }
+  first = 0;
+ }
+
+ if (stats == STATS_JSON)
+  fprintf(out, "\n  ],\n  \"totals\": { \"files\": %d, \"failed\": %d, "
+          "\"bytes\": %lu, \"seconds\": %.6f, \"bytes_per_sec\": %.0f },\n"
+          "  \"latency_ns\": {", files, failed, bytes, total,
+          total > 0 ? (double)bytes / total : 0.0);
+ else
+  fprintf(out, "\nlatency,upper_ns,count\n");
+ for (k = 0; k < LAT_KINDS; k++)
+ {
+  hist = lat + k * HIST_BUCKETS;
+  count = 0;
+  max = -1;
+  for (i = 0; i < HIST_BUCKETS; i++)
+  {
+   count += hist[i];
+   if (hist[i])
+    max = i;
+  }
+  if (stats == STATS_CSV)
+  {
+   for (i = 0; i <= max; i++)
+   {
+    if (hist[i])
+     fprintf(out, "%s,%lu,%lu\n", lat_names[k],
+             (unsigned long int)hist_upper(i), (unsigned long int)hist[i]);
+   }
+   continue;
+  }
+  fprintf(out, "%s\n    \"%s\": { \"count\": %lu", k ? "," : "",
+          lat_names[k], (unsigned long int)count);
+  if (count)
+  {
+   for (p = 0; p < (int)(sizeof pcts / sizeof pcts[0]); p++)
+    fprintf(out, ", \"%s\": %lu", pct_names[p],
+            (unsigned long int)hist_percentile(hist, count, pcts[p]));
+   fprintf(out, ", \"max\": %lu", (unsigned long int)hist_upper(max));
+  }
+  fprintf(out, ", \"buckets\": [");
+  for (i = 0, first = 1; i <= max; i++)
+  {
+   if (!hist[i])
+    continue;
+   fprintf(out, "%s[%lu, %lu]", first ? "" : ", ",
+           (unsigned long int)hist_upper(i), (unsigned long int)hist[i]);
+   first = 0;
+  }
+  fprintf(out, "] }");
+ }
+ if (stats == STATS_JSON)
+  fprintf(out, "\n  }\n}\n");
+ return ferror(out) ? -1 : 0;
+} /* write_stats */
+
+/* The exit code for two results, the higher one is the worse. */
+int worst_result(int a, int b)
+{
+ return a > b ? a : b;
+} /* worst_result */
+
+/* Finish a copied output, with --update its mtime marks it complete for
+   the next run, and list it in the manifest. Returns WRITE_ERROR when the
+   time can't be set. */
+int file_complete(filedata *fdata, FILE *manifest)
+{
+ struct timespec times[2];
+ char hex[HASH_MAX * 2 + 1];
+
+ times[0].tv_sec = 0;
+ times[0].tv_nsec = UTIME_OMIT;
+ times[1] = fdata->mtime;
+ if (update && !fdata->remote &&
+     utimensat(AT_FDCWD, fdata->output_name, times, 0) != 0)
+ {
+  fdata->err = errno;
+  fprintf(stderr, "Error while setting output file time: %s\n",
+          fdata->output_name);
+  fdata->result = WRITE_ERROR;
+  fdata->phase = PHASE_WRITE;
+  return WRITE_ERROR;
+ }
+ if (manifest)
+ {
+  hash_hex(fdata->digest, hash_alg, hex);
+  fprintf(manifest, "%s  %s\n", hex, fdata->output_name);
+ }
+ return EXIT_OK;
+} /* file_complete */
+
+/* Give the directories created by -r the mode of their source, deepest
+   first like cp -a. Returns WRITE_ERROR when one can't be set. */
+int dir_modes(void)
+{
+ filedata *fdata;
+ int i, result = EXIT_OK;
+
+ for (i = ftable.count - 1; i >= 0; i--)
+ {
+  fdata = table_get(&ftable, i);
+  if (!fdata->dir || fdata->mode == 0)
+   continue;
+  if (chmod(fdata->output_name, fdata->mode & 07777) != 0)
+  {
+   fprintf(stderr, "Error while setting directory mode: %s\n",
+           fdata->output_name);
+   result = WRITE_ERROR;
+  }
+ }
+ return result;
+} /* dir_modes */
+
+/* List the failed file pairs on stderr with the phase, errno and input
+   offset of their failure. Returns the worst of their results. */
+int report_failures(void)
+{
+ filedata *fdata;
+ int i, failed = 0, result = EXIT_OK;
+
+ for (i = 0; (fdata = table_get(&ftable, i)) != NULL; i++)
+ {
+  if (fdata->status != TS_CHECKED || fdata->result == EXIT_OK)
+   continue;
+  if (failed++ == 0)
+   fprintf(stderr, "Failed file pair(s):\n");
+  fprintf(stderr, "  [%04d] %s at offset %lu: %s", fdata->index,
+          fdata->phase ? phase_names[fdata->phase] : "copy",
+          fdata->err_offset, fdata->err ? strerror(fdata->err) :
+          fdata->result == VERIFY_ERROR ? "contents differ" : "failed");
+  if (fdata->retries)
+   fprintf(stderr, " after %d retries", fdata->retries);
+  fprintf(stderr, ": %s -> %s\n", fdata->input_name, fdata->output_name);
+  result = worst_result(result, fdata->result);
+ }
+ if (failed)
+  fprintf(stderr, "%d file pair(s) failed.\n", failed);
+ return result;
+} /* report_failures */
+
+/* Generate the synthetic workloads under dir and copy each with every
+   engine, block size and worker count in a child process, reporting
+   wall time, throughput, CPU time and peak RSS from wait4. Returns a
+   command exit code. */
+int run_bench(const char *dir)
+{
+ char src[PATH_MAX], dst[PATH_MAX];
+ char jobs_arg[16], block_arg[32], engine_arg[32];
+ char *args[] = { "threadcopy", "-q", "-r", "-j", jobs_arg, "-b", block_arg,
+                  engine_arg, src, dst, NULL };
+ int jobs[3] = { 1, 0, 0 };
+ int njobs = 1;
+ int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+ unsigned long int bytes;
+ struct rusage ru;
+ double wall, cpu;
+ int w, e, b, j, status;
+
+ /* One worker, four and all online CPUs. */
+ if (cpus > JOBS_MAX)
+  cpus = JOBS_MAX;
+ if (cpus > 1)
+  jobs[njobs++] = cpus < 4 ? cpus : 4;
+ if (cpus > 4)
+  jobs[njobs++] = cpus;
+
+ if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+ {
+  fprintf(stderr, "Error while creating benchmark directory: %s\n", dir);
+  return WRITE_ERROR;
+ }
+ snprintf(dst, sizeof dst, "%s/out", dir);
+ for (w = 0; w < BENCH_LOADS_NUM; w++)
+ {
+  snprintf(src, sizeof src, "%s/%s", dir, bench_loads[w].name);
+  if (bench_workload(src, &bench_loads[w], &bytes) != 0)
+  {
+   fprintf(stderr, "Error while generating benchmark workload: %s\n", src);
+   bench_clear(src);
+   return WRITE_ERROR;
+  }
+  PRINT("%-8s %-8s %7s %4s %9s %8s %8s %8s %6s\n", "Workload", "Engine",
+        "Block", "Jobs", "MiB/s", "Wall s", "CPU s", "RSS MiB", "Result");
+  for (e = ENGINE_AUTO + 1; e < ENGINES_NUM; e++)
+  {
+   for (b = 0; b < BENCH_BLOCKS_NUM; b++)
+   {
+    for (j = 0; j < njobs; j++)
+    {
+     snprintf(jobs_arg, sizeof jobs_arg, "%d", jobs[j]);
+     snprintf(block_arg, sizeof block_arg, "%lu", bench_blocks[b]);
+     snprintf(engine_arg, sizeof engine_arg, "--engine=%s", engines[e].name);
+     bench_clear(dst);
+     bench_drop(src);
+     status = bench_run(args, &ru, &wall);
+     cpu = (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+           (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000;
+     PRINT("%-8s %-8s %6luK %4d %9.1f %8.3f %8.3f %8.1f %6d\n",
+           bench_loads[w].name, engines[e].name, bench_blocks[b] / 1024,
+           jobs[j], status == EXIT_OK && wall > 0 ?
+           (double)bytes / wall / 1048576 : 0.0, wall, cpu,
+           (double)ru.ru_maxrss / 1024, status);
+     fflush(stdout);
+    }
+   }
+  }
+  bench_clear(dst);
+  bench_clear(src);
+ }
+ rmdir(dir);
+ return EXIT_OK;
+} /* run_bench */
+
+/* Write a workload into a fresh directory, contents come from a fixed
+   seed so every run copies the same bytes. Sparse files get BENCH_EXTENT
+   of data every BENCH_HOLE bytes. */
+int bench_workload(const char *dir, const benchload *load,
+                   unsigned long int *bytes)
+{
+ char name[PATH_MAX];
+ unsigned char *buffer;
+ uint64_t seed = BENCH_SEED;
+ unsigned long int size, offset, len, span;
+ int shift, bits, i, fd;
+ size_t k;
+ int result = 0;
+
+ bench_clear(dir);
+ if (mkdir(dir, 0777) != 0 || (buffer = malloc(BENCH_BUFFER)) == NULL)
+  return -1;
+ for (bits = 0; (load->min << bits) < load->max; bits++)
+  ;
+ *bytes = 0;
+ for (i = 0; i < load->files && result == 0; i++)
+ {
+  /* Sizes spread evenly over powers of two between min and max. */
+  size = load->min;
+  if (bits > 0)
+  {
+   shift = (int)(bench_random(&seed) % (uint64_t)(bits + 1));
+   span = load->min << shift;
+   size = span + bench_random(&seed) % span;
+   if (size > load->max)
+    size = load->max;
+  }
+  snprintf(name, sizeof name, "%s/%05d", dir, i);
+  if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+  {
+   result = -1;
+   break;
+  }
+  for (offset = 0; offset < size && result == 0; offset += len)
+  {
+   len = size - offset < BENCH_BUFFER ? size - offset : BENCH_BUFFER;
+   if (load->sparse && offset % BENCH_HOLE >= BENCH_EXTENT)
+    continue;
+   for (k = 0; k < len; k += sizeof seed)
+   {
+    seed = bench_random(&seed) ^ offset;
+    memcpy(buffer + k, &seed, len - k < sizeof seed ? len - k : sizeof seed);
+   }
+   if (pwrite(fd, buffer, (size_t)len, (off_t)offset) != (ssize_t)len)
+    result = -1;
+  }
+  if (result == 0 && (ftruncate(fd, (off_t)size) != 0 || fsync(fd) != 0))
+   result = -1;
+  if (close(fd) != 0)
+   result = -1;
+  *bytes += size;
+ }
+ free(buffer);
+ if (result == 0)
+  PRINT("Workload %s: %d file(s), %.1f MiB\n", load->name, load->files,
+        (double)*bytes / 1048576);
+ return result;
+} /* bench_workload */
+
+/* Xorshift64*, cheap and the same everywhere. */
+uint64_t bench_random(uint64_t *state)
+{
+ *state ^= *state >> 12;
+ *state ^= *state << 25;
+ *state ^= *state >> 27;
+ return *state * 0x2545F4914F6CDD1DULL;
+} /* bench_random */
+
+/* Run a copy in a child, output is discarded and resource usage of the
+   child alone is collected. Returns its exit code, READ_ERROR when it
+   could not run or was killed. */
+int bench_run(char **args, struct rusage *ru, double *wall)
+{
+ pid_t pid;
+ int status, fd;
+ uint64_t start = monotonic_ns();
+
+ memset(ru, 0, sizeof *ru);
+ *wall = 0;
+ fflush(stdout);
+ if ((pid = fork()) < 0)
+  return READ_ERROR;
+ if (pid == 0)
+ {
+  if ((fd = open("/dev/null", O_WRONLY)) >= 0)
+  {
+   dup2(fd, STDOUT_FILENO);
+   dup2(fd, STDERR_FILENO);
+  }
+  execv("/proc/self/exe", args);
+  _exit(READ_ERROR);
+ }
+ while (wait4(pid, &status, 0, ru) < 0)
+ {
+  if (errno != EINTR)
+   return READ_ERROR;
+ }
+ *wall = elapsed(start, monotonic_ns());
+ return WIFEXITED(status) ? WEXITSTATUS(status) : READ_ERROR;
+} /* bench_run */
+
+/* Drop cached pages of a workload so each run reads from the media. */
+void bench_drop(const char *dir)
+{
+ char name[PATH_MAX];
+ DIR *d;
+ struct dirent *de;
+ int fd;
+
+ if ((d = opendir(dir)) == NULL)
+  return;
+ while ((de = readdir(d)) != NULL)
+ {
+  if (de->d_name[0] == '.')
+   continue;
+  snprintf(name, sizeof name, "%s/%s", dir, de->d_name);
+  if ((fd = open(name, O_RDONLY)) < 0)
+   continue;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+ }
+ closedir(d);
+} /* bench_drop */
+
+/* Remove a flat benchmark directory and the files in it. */
+void bench_clear(const char *dir)
+{
+ char name[PATH_MAX];
+ DIR *d;
+ struct dirent *de;
+
+ if ((d = opendir(dir)) == NULL)
+  return;
+ while ((de = readdir(d)) != NULL)
+ {
+  if (de->d_name[0] == '.')
+   continue;
+  snprintf(name, sizeof name, "%s/%s", dir, de->d_name);
+  unlink(name);
+ }
+ closedir(d);
+ rmdir(dir);
+} /* bench_clear */
+
+/* Path part of a host:path or host:port:path output, NULL for a local
+   output. As with scp a colon before any slash makes it remote, so
+   ./a:b is local. Host and port are filled in unless host is NULL. */
+const char *remote_path(const char *name, char *host, size_t hostlen,
+                        int *port)
+{
+ const char *colon = strchr(name, ':');
+ const char *p;
+ size_t len;
+
+ if (colon == NULL || colon == name ||
+     memchr(name, '/', (size_t)(colon - name)) != NULL)
+  return NULL;
+ len = (size_t)(colon - name);
+ for (p = colon + 1; isdigit((unsigned char)*p); p++)
+  ;
+ if (host)
+ {
+  if (len >= hostlen)
+   return NULL;
+  memcpy(host, name, len);
+  host[len] = '\0';
+  *port = p > colon + 1 && *p == ':' ? atoi(colon + 1) : NET_PORT;
+ }
+ return p > colon + 1 && *p == ':' ? p + 1 : colon + 1;
+} /* remote_path */
+
+/* Send a task to the receiver of its output over the connection of the
+   worker. A request is a '<size> <offset> <length> <hash> <path length>'
+   line, the path and the data, the reply a '<result> <digest>' line with
+   the digest of what the receiver wrote when hash is not -1. */
+int copy_remote(copytask *task, int infd)
+{
+ filedata *fdata = task->fdata;
+ workerdata *wdata = task->worker;
+ char host[NET_HOST_MAX], line[NET_LINE];
+ char hex[HASH_MAX * 2 + 1], theirs[HASH_MAX * 2 + 1];
+ const char *path;
+ unsigned long int offset = task->offset, len = task->length;
+ unsigned long int size = fdata->size;
+ struct stat st;
+ int port, alg, result, answer;
+
+ path = remote_path(fdata->output_name, host, sizeof host, &port);
+ if (path == NULL || *path == '\0')
+ {
+  fprintf(stderr, "Bad remote output file: %s\n", fdata->output_name);
+  return WRITE_ERROR;
+ }
+ if (len == COPY_TO_EOF)
+ {
+  /* Whole files go at their current size, the receiver truncates. */
+  if (fstat(infd, &st) != 0)
+  {
+   fprintf(stderr, "Error while reading input file: %s\n",
+           fdata->input_name);
+   return READ_ERROR;
+  }
+  offset = 0;
+  len = size = (unsigned long int)st.st_size;
+ }
+ if (net_connect(wdata, host, port) != 0)
+ {
+  fprintf(stderr, "Error while connecting to receiver: %s\n",
+          fdata->output_name);
+  return WRITE_ERROR;
+ }
+ alg = fdata->verify != VERIFY_NONE ? hash_alg : -1;
+ snprintf(line, sizeof line, "%lu %lu %lu %d %lu\n", size, offset, len, alg,
+          (unsigned long int)strlen(path));
+ task->engine = alg < 0 ? ENGINE_SENDFILE : ENGINE_STDIO;
+ if (write_all(wdata->sock, (const unsigned char *)line, strlen(line),
+               NULL) != 0 ||
+     write_all(wdata->sock, (const unsigned char *)path, strlen(path),
+               NULL) != 0)
+ {
+  fprintf(stderr, "Error while sending to receiver: %s\n",
+          fdata->output_name);
+  result = WRITE_ERROR;
+ }
+ else
+  result = net_send(task, infd, offset, len, alg);
+ if (result == EXIT_OK &&
+     (net_line(wdata->sock, line, sizeof line) <= 0 ||
+      sscanf(line, "%d %64s", &answer, theirs) != 2))
+ {
+  fprintf(stderr, "Error while reading receiver reply: %s\n",
+          fdata->output_name);
+  result = WRITE_ERROR;
+ }
+ else if (result == EXIT_OK && answer != EXIT_OK)
+ {
+  /* The receiver answered, the connection is still in step. */
+  fprintf(stderr, "Receiver failed on output file: %s\n",
+          fdata->output_name);
+  errno = 0;
+  return answer == VERIFY_ERROR ? VERIFY_ERROR : WRITE_ERROR;
+ }
+ else if (result == EXIT_OK && alg >= 0)
+ {
+  hash_final(&wdata->vhash, task->digest);
+  hash_hex(task->digest, alg, hex);
+  if (strcmp(hex, theirs) != 0)
+  {
+   fprintf(stderr, "Verify failed, receiver digest differs: %s -> %s\n",
+           fdata->input_name, fdata->output_name);
+   return VERIFY_ERROR;
+  }
+ }
+ if (result != EXIT_OK)
+ {
+  /* Part of a request may be in flight, start over on a new one. */
+  close(wdata->sock);
+  wdata->sock = -1;
+ }
+ return result;
+} /* copy_remote */
+
+/* Send len bytes of the input from offset to the receiver, zero-copy
+   with sendfile unless the data has to be digested on the way. */
+int net_send(copytask *task, int infd, unsigned long int offset,
+             unsigned long int len, int alg)
+{
+ filedata *fdata = task->fdata;
+ workerdata *wdata = task->worker;
+ unsigned long int done = 0;
+ off_t pos;
+ size_t max, n;
+ ssize_t sent;
+ uint64_t start;
+
+ if (alg >= 0)
+  hash_init(&wdata->vhash, alg);
+ if (lseek(infd, (off_t)offset, SEEK_SET) < 0)
+ {
+  fprintf(stderr, "Error while seeking in file: %s\n", fdata->input_name);
+  return READ_ERROR;
+ }
+ while (done < len)
+ {
+  max = task->engine == ENGINE_STDIO || bw_limit.rate || iops_limit.rate ?
+        blocksize : KCOPY_MAX;
+  n = len - done < max ? (size_t)(len - done) : max;
+  if (task->engine == ENGINE_SENDFILE)
+  {
+   throttle_io(n, 2);
+   pos = (off_t)(offset + done);
+   start = stats ? monotonic_ns() : 0;
+   sent = sendfile(wdata->sock, infd, &pos, n);
+   if (stats)
+    latency_add(latency_hist(task, LAT_COPY), start);
+   if (sent < 0 && errno == EINTR)
+    continue;
+   if (sent < 0 && done == 0 &&
+       kcopy_unsupported(errno, infd, (unsigned long int)pos))
+   {
+    task->engine = ENGINE_STDIO;
+    continue;
+   }
+   if (sent <= 0)
+   {
+    fprintf(stderr, "Error while sending file: %s -> %s\n",
+            fdata->input_name, fdata->output_name);
+    return sent < 0 && (errno == EPIPE || errno == ECONNRESET) ?
+           WRITE_ERROR : READ_ERROR;
+   }
+  }
+  else
+  {
+   /* Falls back from sendfile before anything was sent. */
+   if (done == 0 && lseek(infd, (off_t)offset, SEEK_SET) < 0)
+    return READ_ERROR;
+   if (read_full(infd, wdata->ibuffer, n, latency_hist(task, LAT_READ)) !=
+       (ssize_t)n)
+   {
+    fprintf(stderr, "Error while reading input file: %s\n",
+            fdata->input_name);
+    return READ_ERROR;
+   }
+   if (alg >= 0)
+    hash_update(&wdata->vhash, wdata->ibuffer, n);
+   if (write_all(wdata->sock, wdata->ibuffer, n,
+                 latency_hist(task, LAT_WRITE)) != 0)
+   {
+    fprintf(stderr, "Error while sending to receiver: %s\n",
+            fdata->output_name);
+    return WRITE_ERROR;
+   }
+   sent = (ssize_t)n;
+  }
+  done += (unsigned long int)sent;
+  progress_add(task, (unsigned long int)sent);
+ }
+ return EXIT_OK;
+} /* net_send */
+
+/* Keep one connection per worker, it is only replaced when a task goes
+   to another receiver. Returns 0 when connected. */
+int net_connect(workerdata *wdata, const char *host, int port)
+{
+ char peer[NET_HOST_MAX + 8], service[8], c;
+ struct addrinfo hints, *res, *ai;
+ int sock = -1;
+
+ snprintf(peer, sizeof peer, "%s:%d", host, port);
+ /* The receiver drops idle senders, a closed connection reads EOF. */
+ if (wdata->sock >= 0 && strcmp(peer, wdata->peer) == 0 &&
+     recv(wdata->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+     (errno == EAGAIN || errno == EWOULDBLOCK))
+  return 0;
+ if (wdata->sock >= 0)
+  close(wdata->sock);
+ wdata->sock = -1;
+ memset(&hints, 0, sizeof hints);
+ hints.ai_family = AF_UNSPEC;
+ hints.ai_socktype = SOCK_STREAM;
+ snprintf(service, sizeof service, "%d", port);
+ if (getaddrinfo(host, service, &hints, &res) != 0)
+  return -1;
+ for (ai = res; ai != NULL; ai = ai->ai_next)
+ {
+  if ((sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+   continue;
+  if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+   break;
+  close(sock);
+  sock = -1;
+ }
+ freeaddrinfo(res);
+ if (sock < 0)
+  return -1;
+ wdata->sock = sock;
+ strcpy(wdata->peer, peer);
+ DPRINT("Worker [%04d] connected to receiver: %s\n", wdata->id, peer);
+ return 0;
+} /* net_connect */
+
+/* Read a reply line, the receiver sends nothing past it. Returns its
+   length without the newline, or -1 on error or a closed connection. */
+ssize_t net_line(int fd, char *line, size_t size)
+{
+ size_t len = 0;
+ ssize_t n;
+
+ line[0] = '\0';
+ while (len + 1 < size)
+ {
+  n = read(fd, line + len, size - len - 1);
+  if (n < 0 && errno == EINTR)
+   continue;
+  if (n <= 0)
+   return -1;
+  len += (size_t)n;
+  line[len] = '\0';
+  if (strchr(line, '\n') != NULL)
+   return (ssize_t)(strchr(line, '\n') - line);
+ }
+ return -1;
+} /* net_line */
+
+/* Accept senders on net_bind and port and write what they send under
+   net_root, one thread for each connection. Runs until killed. */
+int run_listen(int port)
+{
+ char service[8];
+ struct addrinfo hints, *res, *ai;
+ struct timeval timeout = { NET_TIMEOUT, 0 };
+ pthread_attr_t attr;
+ pthread_t tid;
+ int lsock = -1, sock, one = 1;
+ int *arg;
+
+ memset(&hints, 0, sizeof hints);
+ hints.ai_family = AF_UNSPEC;
+ hints.ai_socktype = SOCK_STREAM;
+ hints.ai_flags = AI_PASSIVE;
+ snprintf(service, sizeof service, "%d", port);
+ if (getaddrinfo(net_bind, service, &hints, &res) != 0)
+  res = NULL;
+ for (ai = res; ai != NULL; ai = ai->ai_next)
+ {
+  if ((lsock = socket(ai->ai_family, ai->ai_socktype,
+                      ai->ai_protocol)) < 0)
+   continue;
+  setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if (bind(lsock, ai->ai_addr, ai->ai_addrlen) == 0 &&
+      listen(lsock, SOMAXCONN) == 0)
+   break;
+  close(lsock);
+  lsock = -1;
+ }
+ if (res)
+  freeaddrinfo(res);
+ if (lsock < 0)
+ {
+  fprintf(stderr, "Error while listening on %s port: %d\n", net_bind, port);
+  return WRITE_ERROR;
+ }
+ PRINT("Listening on %s port %d, writing under: %s\n", net_bind, port,
+       net_root);
+ pthread_attr_init(&attr);
+ pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+ for (;;)
+ {
+  if ((sock = accept(lsock, NULL, NULL)) < 0)
+  {
+   if (errno == EINTR || errno == ECONNABORTED)
+    continue;
+   fprintf(stderr, "Error while accepting on port: %d\n", port);
+   break;
+  }
+  /* Idle senders are dropped, they don't hold a thread for good. */
+  if (__atomic_add_fetch(&net_conns, 1, __ATOMIC_RELAXED) > NET_CONNS_MAX)
+  {
+   fprintf(stderr, "Refusing sender, %d already connected\n",
+           NET_CONNS_MAX);
+   __atomic_sub_fetch(&net_conns, 1, __ATOMIC_RELAXED);
+   close(sock);
+   continue;
+  }
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+  if ((arg = malloc(sizeof *arg)) == NULL)
+  {
+   __atomic_sub_fetch(&net_conns, 1, __ATOMIC_RELAXED);
+   close(sock);
+   continue;
+  }
+  *arg = sock;
+  if (pthread_create(&tid, &attr, netReceiver, arg) != 0)
+  {
+   fprintf(stderr, "Error creating receiver thread\n");
+   __atomic_sub_fetch(&net_conns, 1, __ATOMIC_RELAXED);
+   close(sock);
+   free(arg);
+  }
+ }
+ pthread_attr_destroy(&attr);
+ close(lsock);
+ return WRITE_ERROR;
+} /* run_listen */
+
+/* Serve the requests of one sender until it disconnects. */
+void *netReceiver(void *arg)
+{
+ int sock = *(int *)arg;
+ FILE *in;
+ unsigned char *buf = NULL;
+ char *line = NULL;
+ size_t line_size = 0;
+
+ free(arg);
+ if ((in = fdopen(sock, "r")) == NULL ||
+     posix_memalign((void **)&buf, (size_t)sysconf(_SC_PAGESIZE),
+                    blocksize) != 0)
+ {
+  fprintf(stderr, "Error allocating %lu byte receiver buffer\n",
+          (unsigned long int)blocksize);
+  if (in)
+   fclose(in);
+  else
+   close(sock);
+  free(buf);
+  __atomic_sub_fetch(&net_conns, 1, __ATOMIC_RELAXED);
+  return NULL;
+ }
+ while (getline(&line, &line_size, in) > 0 &&
+        net_receive(in, sock, buf, line) == 0)
+  ;
+ DPRINT("Sender disconnected\n");
+ free(line);
+ free(buf);
+ fclose(in);
+ __atomic_sub_fetch(&net_conns, 1, __ATOMIC_RELAXED);
+ return NULL;
+} /* netReceiver */
+
+/* Write the data of one request and reply with the result. Failures to
+   write still read the data so the stream stays in step. The output is
+   only cut to the claimed size once the range ending there is in.
+   Returns -1 when the connection is to be dropped. */
+int net_receive(FILE *in, int sock, unsigned char *buf, const char *header)
+{
+ unsigned long int size, offset, len, plen, done = 0;
+ char path[PATH_MAX + 1], reply[NET_LINE], hex[HASH_MAX * 2 + 1] = "-";
+ char *name = NULL;
+ struct stat st;
+ size_t n;
+ int alg, fd = -1, result = EXIT_OK;
+
+ if (sscanf(header, "%lu %lu %lu %d %lu", &size, &offset, &len, &alg,
+            &plen) != 5 || plen == 0 || plen > PATH_MAX || alg < -1 ||
+     alg >= HASHES_NUM || offset > size || len > size - offset ||
+     fread(path, 1, plen, in) != plen)
+ {
+  fprintf(stderr, "Bad request from sender\n");
+  return -1;
+ }
+ path[plen] = '\0';
+ if ((name = net_output(path)) == NULL)
+ {
+  fprintf(stderr, "Refusing output file outside of %s: %s\n", net_root,
+          path);
+  result = WRITE_ERROR;
+ }
+ else if ((fd = net_open(path, offset == 0 && len == size ?
+                             O_RDWR | O_CREAT | O_TRUNC :
+                             O_RDWR | O_CREAT)) < 0 ||
+          lseek(fd, (off_t)offset, SEEK_SET) < 0)
+ {
+  fprintf(stderr, "Error while opening output file: %s\n", name);
+  result = WRITE_ERROR;
+ }
+ while (done < len)
+ {
+  n = len - done < blocksize ? (size_t)(len - done) : blocksize;
+  if (fread(buf, 1, n, in) != n)
+  {
+   fprintf(stderr, "Sender disconnected while sending: %s\n", path);
+   if (fd >= 0)
+    close(fd);
+   free(name);
+   return -1;
+  }
+  if (result == EXIT_OK && write_all(fd, buf, n, NULL) != 0)
+  {
+   fprintf(stderr, "Error while writing output file: %s\n", name);
+   result = WRITE_ERROR;
+  }
+  done += n;
+ }
+ /* A stale output longer than the input loses its tail. */
+ if (result == EXIT_OK && len != size && offset + done == size &&
+     fstat(fd, &st) == 0 && (unsigned long int)st.st_size > size &&
+     ftruncate(fd, (off_t)size) != 0)
+ {
+  fprintf(stderr, "Error while truncating output file: %s\n", name);
+  result = WRITE_ERROR;
+ }
+ if (result == EXIT_OK && (alg >= 0 || sync_mode != SYNC_NONE) &&
+     fdatasync(fd) != 0)
+ {
+  fprintf(stderr, "Error while syncing output file: %s\n", name);
+  result = WRITE_ERROR;
+ }
+ if (result == EXIT_OK && alg >= 0)
+  result = net_digest(fd, offset, len, alg, buf, hex);
+ if (fd >= 0 && close(fd) != 0 && result == EXIT_OK)
+ {
+  fprintf(stderr, "Error while writing output file: %s\n", name);
+  result = WRITE_ERROR;
+ }
+ DPRINT("Received %lu byte(s) at %lu with result %d: %s\n", len, offset,
+        result, name ? name : path);
+ free(name);
+ snprintf(reply, sizeof reply, "%d %s\n", result, hex);
+ return write_all(sock, (const unsigned char *)reply, strlen(reply),
+                  NULL) != 0 ? -1 : 0;
+} /* net_receive */
+
+/* Digest a range of a synced output as read back from the media. */
+int net_digest(int fd, unsigned long int offset, unsigned long int len,
+               int alg, unsigned char *buf, char *hex)
+{
+ unsigned char digest[HASH_MAX];
+ hashstate state;
+ unsigned long int done = 0;
+ size_t n;
+
+ posix_fadvise(fd, (off_t)offset, (off_t)len, POSIX_FADV_DONTNEED);
+ hash_init(&state, alg);
+ while (done < len)
+ {
+  n = len - done < blocksize ? (size_t)(len - done) : blocksize;
+  if (pread(fd, buf, n, (off_t)(offset + done)) != (ssize_t)n)
+   return VERIFY_ERROR;
+  hash_update(&state, buf, n);
+  done += n;
+ }
+ hash_final(&state, digest);
+ hash_hex(digest, alg, hex);
+ return EXIT_OK;
+} /* net_digest */
+
+/* Output path of a request under net_root for messages, NULL when it has
+   a .. component that could leave it. */
+char *net_output(const char *path)
+{
+ const char *p;
+ char *name;
+ size_t len;
+
+ while (*path == '/')
+  path++;
+ for (p = path; *p != '\0'; p += *p == '/')
+ {
+  len = strcspn(p, "/");
+  if (len == 2 && p[0] == '.' && p[1] == '.')
+   return NULL;
+  p += len;
+ }
+ if (*path == '\0' || asprintf(&name, "%s/%s", net_root, path) < 0)
+  return NULL;
+ return name;
+} /* net_output */
+
+/* Open the output of a request from net_root down one component at a
+   time, creating missing directories. Symlinks are not followed so the
+   output stays under the root. Returns -1 with errno set. */
+int net_open(const char *path, int flags)
+{
+ char comp[NAME_MAX + 1];
+ size_t len;
+ int dirfd, fd;
+
+ if ((dirfd = open(net_root, O_RDONLY | O_DIRECTORY)) < 0)
+  return -1;
+ for (;;)
+ {
+  while (*path == '/')
+   path++;
+  if ((len = strcspn(path, "/")) > NAME_MAX)
+  {
+   close(dirfd);
+   errno = ENAMETOOLONG;
+   return -1;
+  }
+  memcpy(comp, path, len);
+  comp[len] = '\0';
+  path += len;
+  while (*path == '/')
+   path++;
+  if (*path == '\0')
+   break;
+  if ((mkdirat(dirfd, comp, 0777) != 0 && errno != EEXIST) ||
+      (fd = openat(dirfd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0)
+  {
+   close(dirfd);
+   return -1;
+  }
+  close(dirfd);
+  dirfd = fd;
+ }
+ fd = openat(dirfd, comp, flags | O_NOFOLLOW, 0666);
+ close(dirfd);
+ return fd;
+} /* net_open */
+
+/* Open the input and take its size, the descriptor is kept for the copy
+   while within budget. With --update an output of the same size and
+   mtime marks the pair skipped. Returns -1 with errno set when the input
+   can't be opened. */
+int probe_file(filedata *fdata)
+{
+ struct stat st;
+ filedata *r;
+ int fd, skip, err;
+
+ if ((fd = open_direct(fdata->input_name, O_RDONLY)) < 0 ||
+     fstat(fd, &st) != 0)
+ {
+  err = errno;
+  fprintf(stderr, "Error while opening input file: %s\n", fdata->input_name);
+  if (fd >= 0)
+   close(fd);
+  errno = err;
+  return -1;
+ }
+ fdata->size = (unsigned long int)st.st_size;
+ fdata->mtime = st.st_mtim;
+ fdata->in_dev = st.st_dev;
+ fdata->out_dev = fdata->remote ? 0 : output_dev(fdata->output_name);
+ /* A fan-out copy is skipped only when every output is unchanged. */
+ skip = update;
+ for (r = fdata; r != NULL; r = r->replica)
+ {
+  if (r != fdata)
+  {
+   r->size = fdata->size;
+   r->mtime = fdata->mtime;
+   r->in_dev = fdata->in_dev;
+   r->out_dev = r->remote ? 0 : output_dev(r->output_name);
+  }
+  if (!update || r->remote || stat(r->output_name, &st) != 0 ||
+      !S_ISREG(st.st_mode) || (unsigned long int)st.st_size != fdata->size ||
+      st.st_mtim.tv_sec != fdata->mtime.tv_sec ||
+      st.st_mtim.tv_nsec != fdata->mtime.tv_nsec)
+   skip = 0;
+ }
+ if (skip)
+ {
+  fdata->skip = 1;
+  close(fd);
+  return 0;
+ }
+ if (__atomic_add_fetch(&fds_held, 1, __ATOMIC_RELAXED) <= fds_hold_max)
+ {
+  fdata->infd = fd;
+ }
+ else
+ {
+  __atomic_sub_fetch(&fds_held, 1, __ATOMIC_RELAXED);
+  close(fd);
+ }
+ return 0;
+} /* probe_file */
+
+/* Hand a pair whose input could not be probed to main as a read error,
+   each output with it, so it is counted and listed like a failed copy.
+   Called by a producer that is not closed yet. */
+void probe_failed(filedata *fdata, int err, int retries)
+{
+ donequeue *dq = &dqueue;
+ filedata *r;
+
+ __atomic_add_fetch(&files_total, 1 + fdata->replicas, __ATOMIC_RELAXED);
+ pthread_mutex_lock(&dq->lock);
+ dq->expected += 1 + fdata->replicas;
+ for (r = fdata; r != NULL; r = r->replica)
+ {
+  r->result = READ_ERROR;
+  r->phase = PHASE_OPEN;
+  r->err = err;
+  r->err_offset = 0;
+  r->retries = retries;
+  done_push(dq, r);
+ }
+ pthread_mutex_unlock(&dq->lock);
+} /* probe_failed */
 
 /* vim:ts=1:sw=1:ft=c:et:ai:
 */